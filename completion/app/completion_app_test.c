@@ -1,12 +1,551 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 
+#include "../driver/completion_test.h"
+
 #define DEVICE "/dev/completion"
 #define BUFFER_SIZE 4096
+#define STREAM_BYTES (8 * 1024 * 1024)
+#define SUBSCRIBERS 3
+
+/*
+ * push STREAM_BYTES through the ring in odd sized pieces and check
+ * that the reader gets every byte exactly once, in order
+ */
+static int stream_test(int fd)
+{
+    static const int sizes[] = { 1, 7, 127, 128, 129, 1000, 4095, 4096, 4097, 9999 };
+    char buf[16384];
+    pid_t write_pid;
+    long done;
+    int status;
+    int n;
+    int i;
+
+    if ((write_pid = fork()) == 0) {
+        for (done = 0, i = 0; done < STREAM_BYTES; done += n, i++) {
+            int len = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+            int j;
+
+            if (len > STREAM_BYTES - done) {
+                len = STREAM_BYTES - done;
+            }
+            for (j = 0; j < len; j++) {
+                buf[j] = (char)((done + j) % 251);
+            }
+            n = write(fd, buf, len);
+            if (n != len) {
+                perror("write thread: short write");
+                exit(1);
+            }
+        }
+        exit(0);
+    }
+
+    for (done = 0, i = 0; done < STREAM_BYTES; done += n, i++) {
+        int len = sizes[(i * 3) % (sizeof(sizes) / sizeof(sizes[0]))];
+        int j;
+
+        n = read(fd, buf, len);
+        if (n <= 0 || n > len) {
+            printf("read thread: read(%d) returned %d\n", len, n);
+            return 1;
+        }
+        for (j = 0; j < n; j++) {
+            if (buf[j] != (char)((done + j) % 251)) {
+                printf("read thread: byte %ld is wrong\n", done + j);
+                return 1;
+            }
+        }
+    }
+
+    waitpid(write_pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        return 1;
+    }
+    printf("stream test: %d bytes ok\n", STREAM_BYTES);
+    return 0;
+}
+
+/*
+ * every subscriber reads one ring's worth in full, then the first one
+ * sleeps while two more rings are written and must see an overrun
+ */
+static int subscriber(int id, int size, int ready_fd, int go_fd)
+{
+    char buf[1000];
+    long done;
+    char c;
+    int fd;
+    int n;
+    int j;
+
+    fd = open(DEVICE, O_RDONLY);
+    if (fd < 0) {
+        perror("subscriber: open " DEVICE " failed");
+        return 1;
+    }
+    write(ready_fd, "r", 1);
+
+    for (done = 0; done < size; done += n) {
+        n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            printf("subscriber %d: read returned %d (%s)\n", id, n, strerror(errno));
+            return 1;
+        }
+        for (j = 0; j < n; j++) {
+            if (buf[j] != (char)((done + j) % 251)) {
+                printf("subscriber %d: byte %ld is wrong\n", id, done + j);
+                return 1;
+            }
+        }
+    }
+    if (id != 0) {
+        return 0;
+    }
+
+    read(go_fd, &c, 1);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    n = read(fd, buf, sizeof(buf));
+    if (n >= 0 || errno != EOVERFLOW) {
+        printf("subscriber %d: expected an overrun, read returned %d\n", id, n);
+        return 1;
+    }
+    /* and we continue at the newest data, of which there is none yet */
+    n = read(fd, buf, sizeof(buf));
+    if (n >= 0 || errno != EAGAIN) {
+        printf("subscriber %d: expected EAGAIN, read returned %d\n", id, n);
+        return 1;
+    }
+    return 0;
+}
+
+static int broadcast_test(int fd)
+{
+    struct completion_ring_hdr *hdr;
+    struct completion_stats st;
+    int ready[2], go[2];
+    pid_t pids[SUBSCRIBERS];
+    char buf[4096];
+    long done;
+    int failed = 0;
+    int status;
+    int size;
+    char c;
+    int n;
+    int i;
+
+    /* only stream mode maps, so learn the ring size first */
+    hdr = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    size = hdr->size;
+    munmap(hdr, sysconf(_SC_PAGESIZE));
+
+    if (ioctl(fd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_BROADCAST)) {
+        perror("COMPLETION_IOC_SET_MODE");
+        return 1;
+    }
+    if (pipe(ready) || pipe(go)) {
+        perror("pipe");
+        return 1;
+    }
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        if ((pids[i] = fork()) == 0) {
+            close(fd);
+            exit(subscriber(i, size, ready[1], go[0]));
+        }
+    }
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        read(ready[0], &c, 1);
+    }
+
+    /* one ring's worth can never overrun anybody */
+    for (done = 0; done < size; done += n) {
+        n = size - done < 777 ? size - done : 777;
+        for (i = 0; i < n; i++) {
+            buf[i] = (char)((done + i) % 251);
+        }
+        if (write(fd, buf, n) != n) {
+            perror("write");
+            return 1;
+        }
+    }
+    /* give the other subscribers time to finish before the flood */
+    sleep(1);
+    memset(buf, 'x', sizeof(buf));
+    for (done = 0; done < 2 * size; done += n) {
+        n = 2 * size - done < sizeof(buf) ? 2 * size - done : sizeof(buf);
+        if (write(fd, buf, n) != n) {
+            perror("write");
+            return 1;
+        }
+    }
+    write(go[1], "g", 1);
+
+    for (i = 0; i < SUBSCRIBERS; i++) {
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            failed = 1;
+        }
+    }
+    if (failed) {
+        return 1;
+    }
+    ioctl(fd, COMPLETION_IOC_GET_STATS, &st);
+    printf("broadcast test: %d subscribers ok, %llu overruns, %llu bytes lost\n",
+           SUBSCRIBERS, (unsigned long long)st.overruns, (unsigned long long)st.overrun_bytes);
+    return 0;
+}
+
+static int join(int fd, unsigned int id, const char *name)
+{
+    struct completion_channel ch;
+
+    memset(&ch, 0, sizeof(ch));
+    ch.id = id;
+    strncpy(ch.name, name, sizeof(ch.name) - 1);
+    if (ioctl(fd, COMPLETION_IOC_JOIN, &ch)) {
+        perror("COMPLETION_IOC_JOIN");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * what is written on channel "a" is seen there, and neither on
+ * channel 7 nor on channel 0
+ */
+static int channel_test(int fd)
+{
+    char msg[] = "on channel a";
+    char buf[64];
+    struct completion_channel ch;
+    int wa, ra, r7;
+    int n;
+
+    wa = open(DEVICE, O_WRONLY);
+    ra = open(DEVICE, O_RDONLY | O_NONBLOCK);
+    r7 = open(DEVICE, O_RDONLY | O_NONBLOCK);
+    if (wa < 0 || ra < 0 || r7 < 0) {
+        perror("open " DEVICE " failed");
+        return 1;
+    }
+    if (join(wa, 0, "a") || join(ra, 0, "a") || join(r7, 7, "")) {
+        return 1;
+    }
+
+    if (write(wa, msg, sizeof(msg)) != sizeof(msg)) {
+        perror("write");
+        return 1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (read(r7, buf, sizeof(buf)) >= 0 || errno != EAGAIN ||
+        read(fd, buf, sizeof(buf)) >= 0 || errno != EAGAIN) {
+        printf("channel test: data leaked to another channel\n");
+        return 1;
+    }
+    n = read(ra, buf, sizeof(buf));
+    if (n != sizeof(msg) || memcmp(buf, msg, n)) {
+        printf("channel test: read %d bytes on channel a\n", n);
+        return 1;
+    }
+    /* ra has used channel a, it cannot leave it any more */
+    memset(&ch, 0, sizeof(ch));
+    ch.id = 7;
+    if (ioctl(ra, COMPLETION_IOC_JOIN, &ch) >= 0 || errno != EBUSY) {
+        printf("channel test: joined another channel after a read\n");
+        return 1;
+    }
+
+    close(wa);
+    close(ra);
+    close(r7);
+    printf("channel test: ok\n");
+    return 0;
+}
+
+/*
+ * write boundaries survive, a short buffer does not lose the record,
+ * and the batch interface returns the rest in one go
+ */
+static int record_test(int fd)
+{
+    static const int sizes[] = { 1, 0, 5, 64, 3, 100 };
+    struct completion_batch b;
+    char buf[512];
+    unsigned int off;
+    int n, i, j;
+
+    if (ioctl(fd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_RECORD)) {
+        perror("COMPLETION_IOC_SET_MODE");
+        return 1;
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        memset(buf, 'a' + i, sizes[i]);
+        if (write(fd, buf, sizes[i]) != sizes[i]) {
+            perror("write");
+            return 1;
+        }
+    }
+
+    n = read(fd, buf, sizeof(buf));
+    if (n != sizes[0] || buf[0] != 'a') {
+        printf("record test: first read returned %d\n", n);
+        return 1;
+    }
+    n = read(fd, buf, sizeof(buf));
+    if (n != 0) {
+        printf("record test: empty record read as %d\n", n);
+        return 1;
+    }
+    n = read(fd, buf, sizes[2] - 1);
+    if (n >= 0 || errno != EMSGSIZE) {
+        printf("record test: short buffer read returned %d\n", n);
+        return 1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.buf = (unsigned long)buf;
+    b.buf_len = sizeof(buf);
+    b.max_msgs = 16;
+    n = ioctl(fd, COMPLETION_IOC_RECV_BATCH, &b);
+    if (n != 4 || b.msgs != 4) {
+        printf("record test: batch returned %d\n", n);
+        return 1;
+    }
+    for (i = 2, off = 0; i < 6; i++, off += COMPLETION_RECORD_NEXT(sizes[i - 1])) {
+        unsigned int len = *(unsigned int *)(buf + off);
+
+        if (len != sizes[i]) {
+            printf("record test: record %d is %u bytes\n", i, len);
+            return 1;
+        }
+        for (j = 0; j < len; j++) {
+            if (buf[off + sizeof(len) + j] != 'a' + i) {
+                printf("record test: record %d is wrong\n", i);
+                return 1;
+            }
+        }
+    }
+    if (off != b.bytes) {
+        printf("record test: batch used %u bytes, records take %u\n", b.bytes, off);
+        return 1;
+    }
+
+    printf("record test: ok\n");
+    return 0;
+}
+
+/*
+ * counter mode sums writes until a read takes them all, semaphore mode
+ * hands them out one by one; neither is readable at zero
+ */
+static int counter_test(int fd)
+{
+    unsigned long long v;
+    int n, i;
+
+    if (ioctl(fd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_COUNTER)) {
+        perror("COMPLETION_IOC_SET_MODE");
+        return 1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    v = 3;
+    write(fd, &v, sizeof(v));
+    v = 4;
+    write(fd, &v, sizeof(v));
+    n = read(fd, &v, sizeof(v));
+    if (n != sizeof(v) || v != 7) {
+        printf("counter test: read returned %d, %llu\n", n, v);
+        return 1;
+    }
+    if (read(fd, &v, sizeof(v)) >= 0 || errno != EAGAIN) {
+        printf("counter test: zero counter is readable\n");
+        return 1;
+    }
+    if (read(fd, &v, sizeof(v) - 1) >= 0 || errno != EINVAL) {
+        printf("counter test: short read did not fail\n");
+        return 1;
+    }
+    v = ~0ULL - 1;
+    write(fd, &v, sizeof(v));
+    v = 1;
+    if (write(fd, &v, sizeof(v)) >= 0 || errno != EOVERFLOW) {
+        printf("counter test: counter overflowed\n");
+        return 1;
+    }
+    read(fd, &v, sizeof(v));
+
+    if (ioctl(fd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_SEMAPHORE)) {
+        perror("COMPLETION_IOC_SET_MODE");
+        return 1;
+    }
+    v = 2;
+    write(fd, &v, sizeof(v));
+    for (i = 0; i < 2; i++) {
+        n = read(fd, &v, sizeof(v));
+        if (n != sizeof(v) || v != 1) {
+            printf("semaphore test: read %d returned %d, %llu\n", i, n, v);
+            return 1;
+        }
+    }
+    if (read(fd, &v, sizeof(v)) >= 0 || errno != EAGAIN) {
+        printf("semaphore test: zero count is readable\n");
+        return 1;
+    }
+    fcntl(fd, F_SETFL, 0);
+
+    printf("counter test: ok\n");
+    return 0;
+}
+
+/*
+ * records come out highest priority first, in order within a level,
+ * and a full level does not stop writers at any other
+ */
+static int priority_test(int fd)
+{
+    static const struct { int prio; const char *msg; } sent[] = {
+        { 0, "bulk 1" }, { 0, "bulk 2" }, { 7, "urgent" }, { 3, "normal 1" },
+        { 0, "bulk 3" }, { 3, "normal 2" },
+    };
+    static const int order[] = { 2, 3, 5, 0, 1, 4 };
+    char buf[64];
+    int n, i;
+
+    if (ioctl(fd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_PRIORITY)) {
+        perror("COMPLETION_IOC_SET_MODE");
+        return 1;
+    }
+    if (ioctl(fd, COMPLETION_IOC_SET_PRIO, COMPLETION_PRIO_LEVELS) >= 0 || errno != EINVAL) {
+        printf("priority test: level %d accepted\n", COMPLETION_PRIO_LEVELS);
+        return 1;
+    }
+    for (i = 0; i < sizeof(sent) / sizeof(sent[0]); i++) {
+        ioctl(fd, COMPLETION_IOC_SET_PRIO, sent[i].prio);
+        if (write(fd, sent[i].msg, strlen(sent[i].msg)) != strlen(sent[i].msg)) {
+            perror("write");
+            return 1;
+        }
+    }
+    for (i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        const char *want = sent[order[i]].msg;
+
+        n = read(fd, buf, sizeof(buf));
+        if (n != strlen(want) || memcmp(buf, want, n)) {
+            printf("priority test: read %d returned %d, expected \"%s\"\n", i, n, want);
+            return 1;
+        }
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    ioctl(fd, COMPLETION_IOC_SET_PRIO, 0);
+    memset(buf, 'b', sizeof(buf));
+    while (write(fd, buf, 4) == 4)
+        ;
+    if (errno != EAGAIN) {
+        perror("write");
+        return 1;
+    }
+    ioctl(fd, COMPLETION_IOC_SET_PRIO, COMPLETION_PRIO_LEVELS - 1);
+    if (write(fd, "urgent", 6) != 6) {
+        printf("priority test: full level 0 blocked level %d\n", COMPLETION_PRIO_LEVELS - 1);
+        return 1;
+    }
+    n = read(fd, buf, sizeof(buf));
+    if (n != 6 || memcmp(buf, "urgent", 6)) {
+        printf("priority test: urgent record did not overtake, read %d\n", n);
+        return 1;
+    }
+    while (read(fd, buf, sizeof(buf)) == 4)
+        ;
+    fcntl(fd, F_SETFL, 0);
+
+    printf("priority test: ok\n");
+    return 0;
+}
+
+static int epoll_events(int ep)
+{
+    struct epoll_event ev;
+
+    if (epoll_wait(ep, &ev, 1, 0) != 1) {
+        return 0;
+    }
+    return ev.events;
+}
+
+/*
+ * readiness follows the ring, O_NONBLOCK and the receive timeout turn
+ * an empty ring into -EAGAIN
+ */
+static int poll_test(int fd)
+{
+    struct completion_timeout to = { 200 };
+    struct epoll_event ev;
+    struct timespec t0, t1;
+    char buf[16];
+    double waited;
+    int ep;
+    int n;
+
+    ep = epoll_create1(0);
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = fd;
+    if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev)) {
+        perror("epoll");
+        return 1;
+    }
+
+    if (epoll_events(ep) != EPOLLOUT) {
+        printf("poll test: empty ring is not just writable\n");
+        return 1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (read(fd, buf, sizeof(buf)) >= 0 || errno != EAGAIN) {
+        printf("poll test: non-blocking read of an empty ring did not fail\n");
+        return 1;
+    }
+    fcntl(fd, F_SETFL, 0);
+
+    write(fd, "x", 1);
+    if (epoll_events(ep) != (EPOLLIN | EPOLLOUT)) {
+        printf("poll test: ring with data is not readable\n");
+        return 1;
+    }
+    read(fd, buf, sizeof(buf));
+
+    if (ioctl(fd, COMPLETION_IOC_SET_TIMEOUT, &to)) {
+        perror("COMPLETION_IOC_SET_TIMEOUT");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    n = read(fd, buf, sizeof(buf));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    waited = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    if (n >= 0 || errno != EAGAIN || waited < to.msecs) {
+        printf("poll test: read returned %d after %.0f ms\n", n, waited);
+        return 1;
+    }
+
+    close(ep);
+    printf("poll test: ok\n");
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -22,6 +561,43 @@ int main(int argc, char *argv[])
             perror("open " DEVICE " failed");
             return errno;
     }
+
+    if (argc > 1 && !strcmp(argv[1], "stream")) {
+        n = stream_test(fd);
+        close(fd);
+        return n;
+    }
+    if (argc > 1 && !strcmp(argv[1], "channels")) {
+        n = channel_test(fd);
+        close(fd);
+        return n;
+    }
+    if (argc > 1 && !strcmp(argv[1], "poll")) {
+        n = poll_test(fd);
+        close(fd);
+        return n;
+    }
+    if (argc > 1 && !strcmp(argv[1], "records")) {
+        n = record_test(fd);
+        close(fd);
+        return n;
+    }
+    if (argc > 1 && !strcmp(argv[1], "priority")) {
+        n = priority_test(fd);
+        close(fd);
+        return n;
+    }
+    if (argc > 1 && !strcmp(argv[1], "counter")) {
+        n = counter_test(fd);
+        close(fd);
+        return n;
+    }
+    if (argc > 1 && !strcmp(argv[1], "broadcast")) {
+        n = broadcast_test(fd);
+        close(fd);
+        return n;
+    }
+
     if ((write_pid = fork()) == 0) {
         for (i = 0; i < 1; i++) {
             n = write(fd, write_buf, sizeof(write_buf));
@@ -37,4 +613,4 @@ int main(int argc, char *argv[])
     close(fd);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,956 @@
+#define _GNU_SOURCE /* splice, vmsplice */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#include "../driver/completion_test.h"
+
+#define DEVICE "/dev/completion"
+
+/*
+ * coalesce: one writer thread sends small messages, one reader thread
+ *           drains them, for several byte thresholds. Context switches
+ *           are counted for the whole process.
+ * mmap:     messages/s through the mmap()ed ring, no system call unless
+ *           a side has to sleep, against one write() and one read() a
+ *           message.
+ * channels: aggregate messages/s of 1, 2, 4... writer/reader pairs,
+ *           each pair on a channel of its own, against all of them
+ *           sharing channel 0.
+ * records:  messages/s and read side system calls a message in record
+ *           mode, one read() a message against batches of up to 4, 16...
+ *           records from COMPLETION_IOC_RECV_BATCH.
+ * splice:   MB/s of 4, 16 and 64 KB payloads that the producer
+ *           vmsplice()s into a pipe and splices into the device and the
+ *           consumer splices out to /dev/null, against write() and
+ *           read() plus write() to /dev/null. Load the module with a
+ *           large ring_size for this one.
+ * latency:  one thread, write() then read() of one message, so nobody
+ *           ever sleeps and only the cost of the system calls shows.
+ * priority: a writer floods a priority mode channel with bulk records
+ *           at level 0 while another sends urgent ones every 100 us;
+ *           the urgent records' latency, queued at the top level against
+ *           queued behind the bulk at level 0.
+ */
+
+static const char *device = DEVICE;
+static int msg_size = 16;
+static long messages = 1000000;
+static unsigned int deadline_us = 100;
+static int max_pairs = 4;
+static int max_batch = 64;
+static int urgent_msgs = 2000;
+
+struct run {
+    unsigned int threshold;
+    int read_fd;
+    int write_fd;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg)
+{
+    struct run *r = arg;
+    char buf[msg_size];
+    long i;
+
+    memset(buf, 'w', sizeof(buf));
+    for (i = 0; i < messages; i++) {
+        if (write(r->write_fd, buf, msg_size) != msg_size) {
+            perror("write");
+            break;
+        }
+    }
+    /* closing flushes whatever the writer held back */
+    close(r->write_fd);
+    return NULL;
+}
+
+static void *reader(void *arg)
+{
+    struct run *r = arg;
+    long long left = (long long)messages * msg_size;
+    char buf[65536];
+    ssize_t n;
+
+    while (left > 0) {
+        n = read(r->read_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            perror("read");
+            break;
+        }
+        left -= n;
+    }
+    return NULL;
+}
+
+static long ctx_switches(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static int run_one(unsigned int threshold)
+{
+    struct completion_coalesce co = { threshold, threshold ? deadline_us : 0 };
+    struct completion_stats before, after;
+    pthread_t rt, wt;
+    struct run r;
+    double start, elapsed;
+    long csw;
+
+    r.threshold = threshold;
+    r.read_fd = open(device, O_RDONLY);
+    r.write_fd = open(device, O_WRONLY);
+    if (r.read_fd < 0 || r.write_fd < 0) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    if (ioctl(r.write_fd, COMPLETION_IOC_SET_COALESCE, &co) ||
+        ioctl(r.read_fd, COMPLETION_IOC_GET_STATS, &before)) {
+        perror("ioctl");
+        return -1;
+    }
+
+    csw = ctx_switches();
+    start = now();
+    pthread_create(&rt, NULL, reader, &r);
+    pthread_create(&wt, NULL, writer, &r);
+    pthread_join(wt, NULL);
+    pthread_join(rt, NULL);
+    elapsed = now() - start;
+    csw = ctx_switches() - csw;
+
+    ioctl(r.read_fd, COMPLETION_IOC_GET_STATS, &after);
+    close(r.read_fd);
+
+    printf("%9u %10.1f %12.0f %12.0f %10llu %10llu %10llu\n",
+           threshold,
+           (double)messages * msg_size / elapsed / (1024 * 1024),
+           messages / elapsed,
+           csw / elapsed,
+           (unsigned long long)(after.wakeups - before.wakeups),
+           (unsigned long long)(after.wakeups_saved - before.wakeups_saved),
+           (unsigned long long)(after.timer_wakeups - before.timer_wakeups));
+    return 0;
+}
+
+static int coalesce_bench(void)
+{
+    static const unsigned int thresholds[] = { 0, 64, 256, 1024, 4096 };
+    int i;
+
+    printf("%d byte messages, %ld of them, %u us deadline\n", msg_size, messages, deadline_us);
+    printf("%9s %10s %12s %12s %10s %10s %10s\n",
+           "threshold", "MB/s", "msgs/s", "csw/s", "wakeups", "saved", "timer");
+    for (i = 0; i < sizeof(thresholds) / sizeof(thresholds[0]); i++) {
+        if (run_one(thresholds[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * the user-space side of struct completion_ring_hdr
+ */
+struct ring {
+    int fd;
+    struct completion_ring_hdr *hdr;
+    char *data;
+    unsigned int size;
+    long syscalls;
+};
+
+static int ring_map(struct ring *r)
+{
+    struct completion_ring_hdr *hdr;
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned int size;
+
+    r->fd = open(device, O_RDWR);
+    if (r->fd < 0) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    /* the header tells how much to map */
+    hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    size = hdr->size;
+    munmap(hdr, page);
+
+    r->hdr = mmap(NULL, page + ((size + page - 1) & ~(page - 1)),
+                  PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->hdr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    r->data = (char *)r->hdr + r->hdr->data_offset;
+    r->size = size;
+    r->syscalls = 0;
+    return 0;
+}
+
+static void ring_put(struct ring *r, const char *msg, unsigned int len)
+{
+    unsigned int head = r->hdr->head;
+    unsigned int i;
+
+    for (;;) {
+        unsigned int tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+
+        if (r->size - (head - tail) >= len) {
+            break;
+        }
+        r->syscalls++;
+        ioctl(r->fd, COMPLETION_IOC_WAIT, COMPLETION_RING_SPACE);
+    }
+    for (i = 0; i < len; i++) {
+        r->data[(head + i) & (r->size - 1)] = msg[i];
+    }
+    __atomic_store_n(&r->hdr->head, head + len, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->hdr->consumer_waiting, __ATOMIC_RELAXED)) {
+        r->syscalls++;
+        ioctl(r->fd, COMPLETION_IOC_DOORBELL, COMPLETION_RING_DATA);
+    }
+}
+
+static void ring_get(struct ring *r, char *msg, unsigned int len)
+{
+    unsigned int tail = r->hdr->tail;
+    unsigned int i;
+
+    for (;;) {
+        unsigned int head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+
+        if (head - tail >= len) {
+            break;
+        }
+        r->syscalls++;
+        ioctl(r->fd, COMPLETION_IOC_WAIT, COMPLETION_RING_DATA);
+    }
+    for (i = 0; i < len; i++) {
+        msg[i] = r->data[(tail + i) & (r->size - 1)];
+    }
+    __atomic_store_n(&r->hdr->tail, tail + len, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->hdr->producer_waiting, __ATOMIC_RELAXED)) {
+        r->syscalls++;
+        ioctl(r->fd, COMPLETION_IOC_DOORBELL, COMPLETION_RING_SPACE);
+    }
+}
+
+static void *mmap_writer(void *arg)
+{
+    struct ring *r = arg;
+    char msg[msg_size];
+    long i;
+
+    memset(msg, 'm', sizeof(msg));
+    for (i = 0; i < messages; i++) {
+        ring_put(r, msg, msg_size);
+    }
+    return NULL;
+}
+
+static void *mmap_reader(void *arg)
+{
+    struct ring *r = arg;
+    char msg[msg_size];
+    long i;
+
+    for (i = 0; i < messages; i++) {
+        ring_get(r, msg, msg_size);
+    }
+    return NULL;
+}
+
+static void *rw_writer(void *arg)
+{
+    struct ring *r = arg;
+    char msg[msg_size];
+    long i;
+
+    memset(msg, 'm', sizeof(msg));
+    for (i = 0; i < messages; i++) {
+        if (write(r->fd, msg, msg_size) != msg_size) {
+            perror("write");
+            break;
+        }
+        r->syscalls++;
+    }
+    return NULL;
+}
+
+static void *rw_reader(void *arg)
+{
+    struct ring *r = arg;
+    char msg[msg_size];
+    long i;
+    ssize_t n;
+    int done;
+
+    /* the device is a byte stream, collect each message in full */
+    for (i = 0; i < messages; i++) {
+        for (done = 0; done < msg_size; done += n) {
+            n = read(r->fd, msg + done, msg_size - done);
+            r->syscalls++;
+            if (n <= 0) {
+                perror("read");
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void mmap_run(const char *name, void *(*wfn)(void *), void *(*rfn)(void *),
+                     struct ring *w, struct ring *r)
+{
+    pthread_t wt, rt;
+    double start, elapsed;
+    long csw;
+
+    w->syscalls = r->syscalls = 0;
+    csw = ctx_switches();
+    start = now();
+    pthread_create(&rt, NULL, rfn, r);
+    pthread_create(&wt, NULL, wfn, w);
+    pthread_join(wt, NULL);
+    pthread_join(rt, NULL);
+    elapsed = now() - start;
+    csw = ctx_switches() - csw;
+
+    printf("%-6s %12.0f %12.2f %12.0f\n", name, messages / elapsed,
+           (double)(w->syscalls + r->syscalls) / messages, csw / elapsed);
+}
+
+static int mmap_bench(void)
+{
+    struct ring w, r;
+
+    if (ring_map(&w) || ring_map(&r)) {
+        return 1;
+    }
+    printf("%d byte messages, %ld of them, %u byte ring\n", msg_size, messages, w.size);
+    printf("%-6s %12s %12s %12s\n", "path", "msgs/s", "syscalls/msg", "csw/s");
+    mmap_run("mmap", mmap_writer, mmap_reader, &w, &r);
+    mmap_run("rw", rw_writer, rw_reader, &w, &r);
+    return 0;
+}
+
+static int latency_bench(void)
+{
+    char msg[msg_size];
+    double start, elapsed;
+    double best = 1e9;
+    long i;
+    int fd;
+
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("open " DEVICE " failed");
+        return 1;
+    }
+    memset(msg, 'l', sizeof(msg));
+
+    start = now();
+    for (i = 0; i < messages; i++) {
+        double t = now();
+
+        if (write(fd, msg, msg_size) != msg_size || read(fd, msg, msg_size) != msg_size) {
+            perror("write/read");
+            close(fd);
+            return 1;
+        }
+        t = now() - t;
+        if (t < best) {
+            best = t;
+        }
+    }
+    elapsed = now() - start;
+    close(fd);
+
+    printf("%d byte messages, %ld write+read pairs\n", msg_size, messages);
+    printf("mean %.0f ns, best %.0f ns a pair\n", elapsed / messages * 1e9, best * 1e9);
+    return 0;
+}
+
+struct pair {
+    pthread_t wt, rt;
+    int write_fd;
+    int read_fd;
+};
+
+static void *pair_writer(void *arg)
+{
+    struct pair *p = arg;
+    char msg[msg_size];
+    long i;
+
+    memset(msg, 'c', sizeof(msg));
+    for (i = 0; i < messages; i++) {
+        if (write(p->write_fd, msg, msg_size) != msg_size) {
+            perror("write");
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *pair_reader(void *arg)
+{
+    struct pair *p = arg;
+    long long left = (long long)messages * msg_size;
+    char buf[65536];
+    ssize_t n;
+
+    while (left > 0) {
+        n = read(p->read_fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (n <= 0) {
+            perror("read");
+            break;
+        }
+        left -= n;
+    }
+    return NULL;
+}
+
+static int pairs_run(int pairs, int separate)
+{
+    struct pair p[pairs];
+    struct completion_channel ch;
+    double start, elapsed;
+    int i;
+
+    for (i = 0; i < pairs; i++) {
+        p[i].write_fd = open(device, O_WRONLY);
+        p[i].read_fd = open(device, O_RDONLY);
+        if (p[i].write_fd < 0 || p[i].read_fd < 0) {
+            perror("open " DEVICE " failed");
+            return -1;
+        }
+        if (separate) {
+            memset(&ch, 0, sizeof(ch));
+            ch.id = i + 1;
+            if (ioctl(p[i].write_fd, COMPLETION_IOC_JOIN, &ch) ||
+                ioctl(p[i].read_fd, COMPLETION_IOC_JOIN, &ch)) {
+                perror("COMPLETION_IOC_JOIN");
+                return -1;
+            }
+        }
+    }
+
+    start = now();
+    for (i = 0; i < pairs; i++) {
+        pthread_create(&p[i].rt, NULL, pair_reader, &p[i]);
+        pthread_create(&p[i].wt, NULL, pair_writer, &p[i]);
+    }
+    for (i = 0; i < pairs; i++) {
+        pthread_join(p[i].wt, NULL);
+        pthread_join(p[i].rt, NULL);
+    }
+    elapsed = now() - start;
+
+    for (i = 0; i < pairs; i++) {
+        close(p[i].write_fd);
+        close(p[i].read_fd);
+    }
+    printf("%5d %-9s %12.0f\n", pairs, separate ? "own" : "shared", pairs * messages / elapsed);
+    return 0;
+}
+
+static int channels_bench(void)
+{
+    int pairs;
+
+    printf("%d byte messages, %ld of them a pair\n", msg_size, messages);
+    printf("%5s %-9s %12s\n", "pairs", "channels", "msgs/s");
+    for (pairs = 1; pairs <= max_pairs; pairs *= 2) {
+        if (pairs_run(pairs, 0) || pairs_run(pairs, 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct records {
+    int write_fd;
+    int read_fd;
+    int batch;       /* 1: read() */
+    long syscalls;   /* on the read side */
+};
+
+static void *record_writer(void *arg)
+{
+    struct records *r = arg;
+    char msg[msg_size];
+    long i;
+
+    memset(msg, 'r', sizeof(msg));
+    for (i = 0; i < messages; i++) {
+        if (write(r->write_fd, msg, msg_size) != msg_size) {
+            perror("write");
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *record_reader(void *arg)
+{
+    struct records *r = arg;
+    int buf_len = r->batch * COMPLETION_RECORD_NEXT(msg_size);
+    struct completion_batch b;
+    char *buf = malloc(buf_len);
+    long left = messages;
+    int n;
+
+    while (buf && left > 0) {
+        r->syscalls++;
+        if (r->batch == 1) {
+            n = read(r->read_fd, buf, msg_size) == msg_size ? 1 : -1;
+        } else {
+            b.buf = (unsigned long)buf;
+            b.buf_len = buf_len;
+            b.max_msgs = r->batch;
+            n = ioctl(r->read_fd, COMPLETION_IOC_RECV_BATCH, &b);
+        }
+        if (n <= 0) {
+            perror("read");
+            break;
+        }
+        left -= n;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int records_run(int batch)
+{
+    struct completion_channel ch;
+    struct records r;
+    pthread_t wt, rt;
+    double start, elapsed;
+
+    /* a channel of our own, since only its sole user may set the mode */
+    memset(&ch, 0, sizeof(ch));
+    strcpy(ch.name, "completion_bench");
+    r.write_fd = open(device, O_WRONLY);
+    if (r.write_fd < 0) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    if (ioctl(r.write_fd, COMPLETION_IOC_JOIN, &ch) ||
+        ioctl(r.write_fd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_RECORD)) {
+        perror("ioctl");
+        return -1;
+    }
+    r.read_fd = open(device, O_RDONLY);
+    if (r.read_fd < 0 || ioctl(r.read_fd, COMPLETION_IOC_JOIN, &ch)) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    r.batch = batch;
+    r.syscalls = 0;
+
+    start = now();
+    pthread_create(&rt, NULL, record_reader, &r);
+    pthread_create(&wt, NULL, record_writer, &r);
+    pthread_join(wt, NULL);
+    pthread_join(rt, NULL);
+    elapsed = now() - start;
+    close(r.write_fd);
+    close(r.read_fd);
+
+    printf("%6d %12.0f %12.3f\n", batch, messages / elapsed, (double)r.syscalls / messages);
+    return 0;
+}
+
+static int records_bench(void)
+{
+    int batch;
+
+    printf("%d byte records, %ld of them\n", msg_size, messages);
+    printf("%6s %12s %12s\n", "batch", "msgs/s", "reads/msg");
+    for (batch = 1; batch <= max_batch; batch *= 4) {
+        if (records_run(batch)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#define SPLICE_TOTAL (256L * 1024 * 1024)
+
+struct bulk {
+    int write_fd;
+    int read_fd;
+    int size;
+    int use_splice;
+};
+
+static void *bulk_writer(void *arg)
+{
+    struct bulk *b = arg;
+    char *buf = malloc(b->size);
+    struct iovec iov;
+    long done;
+    int p[2];
+    ssize_t n, m;
+
+    if (!buf || pipe(p)) {
+        perror("bulk writer");
+        return NULL;
+    }
+    memset(buf, 'b', b->size);
+    for (done = 0; done < SPLICE_TOTAL; done += b->size) {
+        if (!b->use_splice) {
+            if (write(b->write_fd, buf, b->size) != b->size) {
+                perror("write");
+                break;
+            }
+            continue;
+        }
+        /* the pipe refers to our pages, the device copies them once */
+        iov.iov_base = buf;
+        iov.iov_len = b->size;
+        while (iov.iov_len) {
+            n = vmsplice(p[1], &iov, 1, 0);
+            if (n <= 0) {
+                perror("vmsplice");
+                goto out;
+            }
+            iov.iov_base = (char *)iov.iov_base + n;
+            iov.iov_len -= n;
+            for (; n > 0; n -= m) {
+                m = splice(p[0], NULL, b->write_fd, NULL, n, SPLICE_F_MOVE);
+                if (m <= 0) {
+                    perror("splice");
+                    goto out;
+                }
+            }
+        }
+    }
+out:
+    close(p[0]);
+    close(p[1]);
+    free(buf);
+    return NULL;
+}
+
+static void *bulk_reader(void *arg)
+{
+    struct bulk *b = arg;
+    char *buf = malloc(b->size);
+    long left = SPLICE_TOTAL;
+    int null_fd = open("/dev/null", O_WRONLY);
+    int p[2];
+    ssize_t n, m;
+
+    if (!buf || null_fd < 0 || pipe(p)) {
+        perror("bulk reader");
+        return NULL;
+    }
+    while (left > 0) {
+        if (b->use_splice) {
+            n = splice(b->read_fd, NULL, p[1], NULL, b->size, SPLICE_F_MOVE);
+        } else {
+            n = read(b->read_fd, buf, b->size);
+        }
+        if (n <= 0) {
+            perror("read");
+            break;
+        }
+        left -= n;
+        /* hand the data on, by page reference when spliced */
+        for (; n > 0; n -= m) {
+            if (b->use_splice) {
+                m = splice(p[0], NULL, null_fd, NULL, n, SPLICE_F_MOVE);
+            } else {
+                m = write(null_fd, buf, n);
+            }
+            if (m <= 0) {
+                perror("write /dev/null");
+                left = 0;
+                break;
+            }
+        }
+    }
+    close(p[0]);
+    close(p[1]);
+    close(null_fd);
+    free(buf);
+    return NULL;
+}
+
+static int splice_bench(void)
+{
+    static const int sizes[] = { 4096, 16384, 65536 };
+    pthread_t wt, rt;
+    struct bulk b;
+    double start, elapsed;
+    int i;
+
+    printf("%ld MB a run\n", SPLICE_TOTAL >> 20);
+    printf("%8s %-8s %10s\n", "payload", "path", "MB/s");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (b.use_splice = 0; b.use_splice <= 1; b.use_splice++) {
+            b.size = sizes[i];
+            b.write_fd = open(device, O_WRONLY);
+            b.read_fd = open(device, O_RDONLY);
+            if (b.write_fd < 0 || b.read_fd < 0) {
+                perror("open " DEVICE " failed");
+                return 1;
+            }
+            start = now();
+            pthread_create(&rt, NULL, bulk_reader, &b);
+            pthread_create(&wt, NULL, bulk_writer, &b);
+            pthread_join(wt, NULL);
+            pthread_join(rt, NULL);
+            elapsed = now() - start;
+            close(b.write_fd);
+            close(b.read_fd);
+            printf("%8d %-8s %10.1f\n", b.size, b.use_splice ? "splice" : "rw",
+                   SPLICE_TOTAL / elapsed / (1024 * 1024));
+        }
+    }
+    return 0;
+}
+
+struct flood {
+    int bulk_fd;
+    int urgent_fd;
+    int read_fd;
+    volatile int stop;
+    double *latency;
+    long urgent;
+};
+
+/* an urgent record carries the time it was sent, after the tag */
+#define STAMP_OFFSET 8
+#define PRIO_MSG_MIN (STAMP_OFFSET + (int)sizeof(double))
+
+static void *flood_writer(void *arg)
+{
+    struct flood *f = arg;
+    char msg[msg_size];
+
+    memset(msg, 'b', sizeof(msg));
+    while (!f->stop) {
+        if (write(f->bulk_fd, msg, msg_size) != msg_size) {
+            perror("write");
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *urgent_writer(void *arg)
+{
+    struct flood *f = arg;
+    struct timespec gap = { 0, 100000 };
+    char msg[msg_size];
+    double t;
+    int i;
+
+    memset(msg, 'u', sizeof(msg));
+    for (i = 0; i < urgent_msgs; i++) {
+        nanosleep(&gap, NULL);
+        t = now();
+        memcpy(msg + STAMP_OFFSET, &t, sizeof(t));
+        if (write(f->urgent_fd, msg, msg_size) != msg_size) {
+            perror("write");
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *flood_reader(void *arg)
+{
+    struct flood *f = arg;
+    char msg[msg_size];
+    double t;
+
+    while (f->urgent < urgent_msgs) {
+        if (read(f->read_fd, msg, msg_size) != msg_size) {
+            perror("read");
+            break;
+        }
+        if (msg[0] == 'u') {
+            memcpy(&t, msg + STAMP_OFFSET, sizeof(t));
+            f->latency[f->urgent++] = now() - t;
+        }
+    }
+    f->stop = 1;
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int flood_run(const char *name, int urgent_prio)
+{
+    struct completion_channel ch;
+    struct flood f;
+    pthread_t bt, ut, rt;
+    double *l;
+
+    memset(&ch, 0, sizeof(ch));
+    strcpy(ch.name, "completion_bench");
+    memset(&f, 0, sizeof(f));
+    f.bulk_fd = open(device, O_WRONLY);
+    if (f.bulk_fd < 0) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    if (ioctl(f.bulk_fd, COMPLETION_IOC_JOIN, &ch) ||
+        ioctl(f.bulk_fd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_PRIORITY)) {
+        perror("ioctl");
+        return -1;
+    }
+    f.urgent_fd = open(device, O_WRONLY);
+    f.read_fd = open(device, O_RDONLY);
+    if (f.urgent_fd < 0 || f.read_fd < 0 ||
+        ioctl(f.urgent_fd, COMPLETION_IOC_JOIN, &ch) ||
+        ioctl(f.read_fd, COMPLETION_IOC_JOIN, &ch) ||
+        ioctl(f.urgent_fd, COMPLETION_IOC_SET_PRIO, urgent_prio)) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    f.latency = l = calloc(urgent_msgs, sizeof(*l));
+
+    pthread_create(&rt, NULL, flood_reader, &f);
+    pthread_create(&bt, NULL, flood_writer, &f);
+    pthread_create(&ut, NULL, urgent_writer, &f);
+    pthread_join(ut, NULL);
+    pthread_join(rt, NULL);
+    /* the flood writer may sleep on a full level, nobody reads any more */
+    close(f.read_fd);
+    pthread_cancel(bt);
+    pthread_join(bt, NULL);
+    close(f.bulk_fd);
+    close(f.urgent_fd);
+
+    qsort(l, f.urgent, sizeof(*l), cmp_double);
+    if (f.urgent > 0) {
+        printf("%-12s %10.1f %10.1f %10.1f %10.1f\n", name, l[f.urgent / 2] * 1e6,
+               l[f.urgent * 99 / 100] * 1e6, l[f.urgent * 999 / 1000] * 1e6,
+               l[f.urgent - 1] * 1e6);
+    }
+    free(l);
+    return 0;
+}
+
+static int priority_bench(void)
+{
+    if (msg_size < PRIO_MSG_MIN) {
+        msg_size = PRIO_MSG_MIN;
+    }
+    printf("%d byte records, %d urgent ones against a flood of bulk ones\n",
+           msg_size, urgent_msgs);
+    printf("%-12s %10s %10s %10s %10s\n", "urgent at", "p50 us", "p99 us", "p999 us", "max us");
+    if (flood_run("level 7", COMPLETION_PRIO_LEVELS - 1) ||
+        flood_run("level 0", 0)) {
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: completion_bench coalesce [msg bytes] [messages] [deadline us]\n"
+                    "       completion_bench mmap [msg bytes] [messages]\n"
+                    "       completion_bench channels [msg bytes] [messages] [max pairs]\n"
+                    "       completion_bench records [msg bytes] [messages] [max batch]\n"
+                    "       completion_bench splice\n"
+                    "       completion_bench latency [msg bytes] [messages]\n"
+                    "       completion_bench priority [msg bytes] [messages] [urgent messages]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = "coalesce";
+    int extra = -1;
+
+    if (argc > 1) {
+        mode = argv[1];
+    }
+    if (argc > 2) {
+        msg_size = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        messages = atol(argv[3]);
+    }
+    if (argc > 4) {
+        extra = atoi(argv[4]);
+    }
+    if (msg_size <= 0 || msg_size > 65536 || messages <= 0 || (argc > 4 && extra <= 0)) {
+        usage();
+        return 1;
+    }
+
+    if (!strcmp(mode, "coalesce")) {
+        if (extra > 0) {
+            deadline_us = extra;
+        }
+        return coalesce_bench();
+    }
+    if (!strcmp(mode, "mmap")) {
+        return mmap_bench();
+    }
+    if (!strcmp(mode, "channels")) {
+        if (extra > 0) {
+            max_pairs = extra;
+        }
+        return channels_bench();
+    }
+    if (!strcmp(mode, "records")) {
+        if (extra > 0) {
+            max_batch = extra;
+        }
+        return records_bench();
+    }
+    if (!strcmp(mode, "splice")) {
+        return splice_bench();
+    }
+    if (!strcmp(mode, "latency")) {
+        return latency_bench();
+    }
+    if (!strcmp(mode, "priority")) {
+        if (extra > 0) {
+            urgent_msgs = extra;
+        }
+        return priority_bench();
+    }
+    usage();
+    return 1;
+}
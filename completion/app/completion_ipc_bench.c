@@ -0,0 +1,691 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "../driver/completion_test.h"
+
+#define DEVICE "/dev/completion"
+#define MAX_MSG 65536
+#define FUTEX_RING (256 * 1024)
+#define HIST_BUCKETS 40 /* bucket b: [2^b, 2^(b+1)) ns, the last takes the rest */
+
+/*
+ * One producer thread, one consumer thread, several ways to get bytes
+ * from one to the other:
+ *
+ * latency:    the producer stamps the time and sends one message to a
+ *             consumer that is asleep; the consumer stamps the time it
+ *             runs again. One-way wake-to-run latency, p50/p99/p999,
+ *             a histogram in power of two buckets, and the CPU time
+ *             the consumer burns a message.
+ * throughput: the producer streams messages as fast as the consumer
+ *             takes them.
+ *
+ * completion: /dev/completion, write() and read()
+ * completion-spin: the same, the reader polls before it sleeps
+ * completion-counter: /dev/completion in counter mode, like eventfd
+ * pipe:       pipe(2)
+ * eventfd:    eventfd(2), carries a counter only, so 8 byte messages
+ * futex:      a ring in process memory, futex(2) only to sleep and wake
+ */
+
+struct transport;
+
+struct transport_ops {
+    const char *name;
+    int (*setup)(struct transport *t);
+    void (*teardown)(struct transport *t);
+    int (*send)(struct transport *t, const char *buf, int len);
+    /* up to len bytes, at least one, sleeping if there is nothing */
+    int (*recv)(struct transport *t, char *buf, int len);
+    int fixed_size; /* the only message size it carries, 0: any */
+};
+
+struct futex_ring {
+    unsigned int head;
+    int producer_waiting;
+    char pad0[56];
+    unsigned int tail;
+    int consumer_waiting;
+    char pad1[56];
+    char data[FUTEX_RING];
+};
+
+struct transport {
+    const struct transport_ops *ops;
+    int rfd;
+    int wfd;
+    struct futex_ring *ring;
+};
+
+static int msg_sizes[16] = { 8, 64, 512, 4096 };
+static int nr_sizes = 4;
+static long iterations = 100000;
+static long stream_messages = 1000000;
+static int producer_cpu = -1;
+static int consumer_cpu = -1;
+static int json;
+static int json_first = 1;
+static unsigned int spin_usecs = 50;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* write or read all len bytes of a byte stream */
+static int fd_send(struct transport *t, const char *buf, int len)
+{
+    int done, n;
+
+    for (done = 0; done < len; done += n) {
+        n = write(t->wfd, buf + done, len - done);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int fd_recv(struct transport *t, char *buf, int len)
+{
+    return read(t->rfd, buf, len);
+}
+
+static void fd_teardown(struct transport *t)
+{
+    close(t->rfd);
+    if (t->wfd != t->rfd) {
+        close(t->wfd);
+    }
+}
+
+static int completion_setup(struct transport *t)
+{
+    t->rfd = open(DEVICE, O_RDONLY);
+    t->wfd = open(DEVICE, O_WRONLY);
+    if (t->rfd < 0 || t->wfd < 0) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    return 0;
+}
+
+static int completion_spin_setup(struct transport *t)
+{
+    struct completion_spin sp = { spin_usecs };
+
+    if (completion_setup(t)) {
+        return -1;
+    }
+    if (ioctl(t->rfd, COMPLETION_IOC_SET_SPIN, &sp)) {
+        perror("COMPLETION_IOC_SET_SPIN");
+        return -1;
+    }
+    return 0;
+}
+
+/* the mode can only be set while the writer is alone on the channel */
+static int completion_counter_setup(struct transport *t)
+{
+    t->wfd = open(DEVICE, O_WRONLY);
+    if (t->wfd < 0) {
+        perror("open " DEVICE " failed");
+        return -1;
+    }
+    if (ioctl(t->wfd, COMPLETION_IOC_SET_MODE, COMPLETION_MODE_COUNTER)) {
+        perror("COMPLETION_IOC_SET_MODE");
+        close(t->wfd);
+        return -1;
+    }
+    t->rfd = open(DEVICE, O_RDONLY);
+    if (t->rfd < 0) {
+        perror("open " DEVICE " failed");
+        close(t->wfd);
+        return -1;
+    }
+    return 0;
+}
+
+static int pipe_setup(struct transport *t)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        perror("pipe");
+        return -1;
+    }
+    t->rfd = fds[0];
+    t->wfd = fds[1];
+    return 0;
+}
+
+static int eventfd_setup(struct transport *t)
+{
+    t->rfd = t->wfd = eventfd(0, 0);
+    if (t->rfd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+/* one message is a count of one, whatever the counter adds up to */
+static int eventfd_send(struct transport *t, const char *buf, int len)
+{
+    unsigned long long one = 1;
+
+    return write(t->wfd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+static int eventfd_recv(struct transport *t, char *buf, int len)
+{
+    unsigned long long count;
+
+    if (read(t->rfd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count * sizeof(count);
+}
+
+static long futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static int futex_setup(struct transport *t)
+{
+    t->ring = calloc(1, sizeof(*t->ring));
+    if (!t->ring) {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+static void futex_teardown(struct transport *t)
+{
+    free(t->ring);
+}
+
+/*
+ * the same protocol as the mmap()ed completion ring: publish the index,
+ * full barrier, wake the other side only if it said it sleeps
+ */
+static void futex_sleep(int *waiting, unsigned int *index, unsigned int seen)
+{
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == seen) {
+        futex((int *)index, FUTEX_WAIT_PRIVATE, seen);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+static void futex_wake(int *waiting, unsigned int *index)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        futex((int *)index, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static int futex_send(struct transport *t, const char *buf, int len)
+{
+    struct futex_ring *r = t->ring;
+    unsigned int head = r->head;
+    unsigned int tail;
+    unsigned int off, first;
+
+    while (FUTEX_RING - (head - (tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))) < len) {
+        futex_sleep(&r->producer_waiting, &r->tail, tail);
+    }
+    off = head % FUTEX_RING;
+    first = len < FUTEX_RING - off ? len : FUTEX_RING - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, buf + first, len - first);
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+    futex_wake(&r->consumer_waiting, &r->head);
+    return 0;
+}
+
+static int futex_recv(struct transport *t, char *buf, int len)
+{
+    struct futex_ring *r = t->ring;
+    unsigned int tail = r->tail;
+    unsigned int head;
+    unsigned int off, first;
+
+    while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail) {
+        futex_sleep(&r->consumer_waiting, &r->head, head);
+    }
+    if (len > head - tail) {
+        len = head - tail;
+    }
+    off = tail % FUTEX_RING;
+    first = len < FUTEX_RING - off ? len : FUTEX_RING - off;
+    memcpy(buf, r->data + off, first);
+    memcpy(buf + first, r->data, len - first);
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+    futex_wake(&r->producer_waiting, &r->tail);
+    return len;
+}
+
+static const struct transport_ops transports[] = {
+    { "completion", completion_setup, fd_teardown, fd_send, fd_recv, 0 },
+    { "completion-spin", completion_spin_setup, fd_teardown, fd_send, fd_recv, 0 },
+    { "completion-counter", completion_counter_setup, fd_teardown, eventfd_send, eventfd_recv, 8 },
+    { "pipe", pipe_setup, fd_teardown, fd_send, fd_recv, 0 },
+    { "eventfd", eventfd_setup, fd_teardown, eventfd_send, eventfd_recv, 8 },
+    { "futex", futex_setup, futex_teardown, futex_send, futex_recv, 0 },
+};
+
+#define NR_TRANSPORTS (sizeof(transports) / sizeof(transports[0]))
+
+/*
+ * what the two threads of one run share
+ */
+struct run {
+    struct transport t;
+    int size;
+    long count;
+    double *samples;     /* latency: one a message */
+    double sent_at;      /* latency: when the producer sent */
+    long acked;          /* latency: messages the consumer has taken */
+    double consumer_cpu; /* seconds of CPU the consumer used */
+    int failed;
+};
+
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        fprintf(stderr, "cannot run on cpu %d\n", cpu);
+    }
+}
+
+/* receive exactly len bytes */
+static int recv_all(struct run *r, char *buf, int len)
+{
+    int done, n;
+
+    for (done = 0; done < len; done += n) {
+        n = r->t.ops->recv(&r->t, buf + done, len - done);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *latency_producer(void *arg)
+{
+    struct run *r = arg;
+    char buf[MAX_MSG];
+    double sent_at;
+    double until;
+    long i;
+
+    pin(producer_cpu);
+    memset(buf, 'p', r->size);
+    for (i = 0; i < r->count; i++) {
+        /* the consumer took the last one; give it time to fall asleep */
+        while (__atomic_load_n(&r->acked, __ATOMIC_ACQUIRE) != i) {
+            sched_yield();
+        }
+        until = now() + 20e-6;
+        while (now() < until)
+            ;
+        sent_at = now();
+        __atomic_store(&r->sent_at, &sent_at, __ATOMIC_RELEASE);
+        if (r->t.ops->send(&r->t, buf, r->size)) {
+            r->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static double thread_cpu(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *latency_consumer(void *arg)
+{
+    struct run *r = arg;
+    char buf[MAX_MSG];
+    double sent_at;
+    double cpu;
+    long i;
+
+    pin(consumer_cpu);
+    cpu = thread_cpu();
+    for (i = 0; i < r->count; i++) {
+        if (recv_all(r, buf, r->size)) {
+            r->failed = 1;
+            break;
+        }
+        __atomic_load(&r->sent_at, &sent_at, __ATOMIC_ACQUIRE);
+        r->samples[i] = now() - sent_at;
+        __atomic_store_n(&r->acked, i + 1, __ATOMIC_RELEASE);
+    }
+    r->consumer_cpu = thread_cpu() - cpu;
+    return NULL;
+}
+
+static void *stream_producer(void *arg)
+{
+    struct run *r = arg;
+    char buf[MAX_MSG];
+    long i;
+
+    pin(producer_cpu);
+    memset(buf, 's', r->size);
+    for (i = 0; i < r->count; i++) {
+        if (r->t.ops->send(&r->t, buf, r->size)) {
+            r->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *stream_consumer(void *arg)
+{
+    struct run *r = arg;
+    long long left = (long long)r->count * r->size;
+    char buf[MAX_MSG];
+    int n;
+
+    pin(consumer_cpu);
+    while (left > 0) {
+        n = r->t.ops->recv(&r->t, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (n <= 0) {
+            r->failed = 1;
+            break;
+        }
+        left -= n;
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double *sorted, long n, double p)
+{
+    long i = (long)(p * n);
+
+    return sorted[i < n ? i : n - 1];
+}
+
+/* count samples into log2 buckets of nanoseconds, return the highest used */
+static int histogram(const double *samples, long n, long *buckets)
+{
+    int top = 0;
+    long i;
+
+    memset(buckets, 0, HIST_BUCKETS * sizeof(*buckets));
+    for (i = 0; i < n; i++) {
+        unsigned long long ns = samples[i] * 1e9;
+        int b = 0;
+
+        while (b < HIST_BUCKETS - 1 && ns >> (b + 1)) {
+            b++;
+        }
+        buckets[b]++;
+        if (b > top) {
+            top = b;
+        }
+    }
+    return top;
+}
+
+static void json_begin(void)
+{
+    printf("%s\n  ", json_first ? "[" : ",");
+    json_first = 0;
+}
+
+static int run_pair(struct run *r, void *(*producer)(void *), void *(*consumer)(void *),
+                    double *elapsed)
+{
+    pthread_t pt, ct;
+    double start;
+
+    if (r->t.ops->setup(&r->t)) {
+        return -1;
+    }
+    start = now();
+    pthread_create(&ct, NULL, consumer, r);
+    pthread_create(&pt, NULL, producer, r);
+    pthread_join(pt, NULL);
+    pthread_join(ct, NULL);
+    *elapsed = now() - start;
+    r->t.ops->teardown(&r->t);
+    return r->failed ? -1 : 0;
+}
+
+static int latency_test(const struct transport_ops *ops, int size)
+{
+    struct run r;
+    double elapsed;
+    double p50, p99, p999, max;
+    double cpu;
+    long buckets[HIST_BUCKETS];
+    char range[48];
+    int bottom, top, b;
+
+    memset(&r, 0, sizeof(r));
+    r.t.ops = ops;
+    r.size = size;
+    r.count = iterations;
+    r.samples = malloc(iterations * sizeof(*r.samples));
+    if (!r.samples) {
+        perror("malloc");
+        return -1;
+    }
+    if (run_pair(&r, latency_producer, latency_consumer, &elapsed)) {
+        fprintf(stderr, "%s latency run failed\n", ops->name);
+        free(r.samples);
+        return -1;
+    }
+
+    qsort(r.samples, iterations, sizeof(*r.samples), cmp_double);
+    p50 = percentile(r.samples, iterations, 0.5) * 1e9;
+    p99 = percentile(r.samples, iterations, 0.99) * 1e9;
+    p999 = percentile(r.samples, iterations, 0.999) * 1e9;
+    max = r.samples[iterations - 1] * 1e9;
+    cpu = r.consumer_cpu / iterations * 1e9;
+    top = histogram(r.samples, iterations, buckets);
+    bottom = 0;
+    while (!buckets[bottom]) {
+        bottom++;
+    }
+    free(r.samples);
+
+    if (json) {
+        json_begin();
+        printf("{\"transport\": \"%s\", \"test\": \"latency\", \"size\": %d, \"samples\": %ld, "
+               "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f, \"max_ns\": %.0f, "
+               "\"consumer_cpu_ns\": %.0f, \"histogram\": [",
+               ops->name, size, iterations, p50, p99, p999, max, cpu);
+        for (b = bottom; b <= top; b++) {
+            printf("%s{\"lo_ns\": %llu, \"hi_ns\": %llu, \"count\": %ld}", b > bottom ? ", " : "",
+                   1ULL << b, 1ULL << (b + 1), buckets[b]);
+        }
+        printf("]}");
+    } else {
+        printf("%-15s %-10s %6d %12.0f %12.0f %12.0f %12.0f %12.0f\n",
+               ops->name, "latency", size, p50, p99, p999, max, cpu);
+        for (b = bottom; b <= top; b++) {
+            snprintf(range, sizeof(range), "%llu-%llu ns", 1ULL << b, 1ULL << (b + 1));
+            printf("%-15s %-10s %6s %25s %12ld %11.2f%%\n", "", "", "", range,
+                   buckets[b], 100.0 * buckets[b] / iterations);
+        }
+    }
+    return 0;
+}
+
+static int throughput_test(const struct transport_ops *ops, int size)
+{
+    struct run r;
+    double elapsed;
+
+    memset(&r, 0, sizeof(r));
+    r.t.ops = ops;
+    r.size = size;
+    r.count = stream_messages;
+    if (run_pair(&r, stream_producer, stream_consumer, &elapsed)) {
+        fprintf(stderr, "%s throughput run failed\n", ops->name);
+        return -1;
+    }
+
+    if (json) {
+        json_begin();
+        printf("{\"transport\": \"%s\", \"test\": \"throughput\", \"size\": %d, \"messages\": %ld, "
+               "\"msgs_per_s\": %.0f, \"mb_per_s\": %.1f}",
+               ops->name, size, stream_messages, stream_messages / elapsed,
+               (double)stream_messages * size / elapsed / (1024 * 1024));
+    } else {
+        printf("%-15s %-10s %6d %12.0f %12.1f\n", ops->name, "throughput", size,
+               stream_messages / elapsed, (double)stream_messages * size / elapsed / (1024 * 1024));
+    }
+    return 0;
+}
+
+/* is name one of the comma separated list */
+static int selected(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p;
+
+    if (!list) {
+        return 1;
+    }
+    for (p = list; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: completion_ipc_bench [-t transport[,transport...]] [-s size[,size...]]\n"
+            "                            [-n latency samples] [-m stream messages]\n"
+            "                            [-c producer cpu,consumer cpu] [-S spin usecs] [-j]\n"
+            "transports: completion completion-spin completion-counter pipe eventfd futex (default all)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *only = NULL;
+    char *s;
+    unsigned int i;
+    int j;
+    int opt;
+    int err = 0;
+
+    while ((opt = getopt(argc, argv, "t:s:n:m:c:S:j")) != -1) {
+        switch (opt) {
+        case 't':
+            only = optarg;
+            break;
+        case 's':
+            for (nr_sizes = 0, s = strtok(optarg, ","); s && nr_sizes < 16; s = strtok(NULL, ",")) {
+                msg_sizes[nr_sizes++] = atoi(s);
+            }
+            break;
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'm':
+            stream_messages = atol(optarg);
+            break;
+        case 'c':
+            if (sscanf(optarg, "%d,%d", &producer_cpu, &consumer_cpu) != 2) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'S':
+            spin_usecs = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (iterations <= 0 || stream_messages <= 0 || nr_sizes == 0) {
+        usage();
+        return 1;
+    }
+    for (j = 0; j < nr_sizes; j++) {
+        if (msg_sizes[j] <= 0 || msg_sizes[j] > MAX_MSG) {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!json) {
+        printf("%-15s %-10s %6s %12s %12s %12s %12s %12s\n",
+               "transport", "test", "size", "p50 ns", "p99 ns", "p999 ns", "max ns", "cpu ns");
+        printf("%-15s %-10s %6s %12s %12s\n", "", "", "", "msgs/s", "MB/s");
+    }
+    for (i = 0; i < NR_TRANSPORTS; i++) {
+        const struct transport_ops *ops = &transports[i];
+
+        if (!selected(only, ops->name)) {
+            continue;
+        }
+        for (j = 0; j < nr_sizes; j++) {
+            int size = ops->fixed_size ? ops->fixed_size : msg_sizes[j];
+
+            if (ops->fixed_size && j > 0) {
+                break;
+            }
+            err |= latency_test(ops, size);
+            err |= throughput_test(ops, size);
+        }
+    }
+    if (json) {
+        printf("%s\n", json_first ? "[]" : "\n]");
+    }
+
+    return err ? 1 : 0;
+}
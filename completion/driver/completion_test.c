@@ -1,56 +1,1531 @@
-#include <linux/module.h>  
-#include <linux/init.h>  
-#include <linux/device.h> 
-#include <linux/sched.h>  
-#include <linux/fs.h>  
-#include <linux/completion.h>  
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/bitops.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include <linux/stat.h>  /* S_IRUGO/S_IWUGO */
-#include <asm/uaccess.h> /* copy_to_user/copy_from_user */
+#include <linux/uaccess.h> /* copy_to_user/copy_from_user */
 #include <linux/string.h>
+#include <linux/uio.h>
 
-#define BUFFER_SIZE 128
+#include "completion_test.h"
+
+#define CREATE_TRACE_POINTS
+#include "completion_trace.h"
+
+#define RING_SIZE_MIN 64
+#define RING_SIZE_MAX (16 * 1024 * 1024)
 #define COMPLETE_DEV_NAME "completion"
-DECLARE_COMPLETION(comp);
-static char completion_buffer[BUFFER_SIZE] = { 0 };
-static unsigned int read_index = 0;
-static unsigned int write_index = 0;
 
-ssize_t completion_read(struct file *filp, char __user *buf, size_t count, loff_t *pos)
+static unsigned int ring_size = 4096;
+module_param(ring_size, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "ring capacity in bytes, rounded up to a power of two");
+
+/*
+ * A byte ring. head and tail run freely and are masked on use, so
+ * head - tail is the number of queued bytes even across the wrap.
+ * head is only written by the producer and tail only by the consumer;
+ * write_lock and read_lock serialise several producers or consumers.
+ *
+ * head and tail live in a header page in front of the data, and the
+ * whole thing can be mmap()ed, so user space can move data without
+ * any system call (struct completion_ring_hdr).
+ *
+ * Each channel is one such ring. Nothing but joining and leaving
+ * touches state shared between channels.
+ */
+struct completion_chan {
+    struct completion_ring_hdr *hdr;
+    struct completion_channel id;
+    struct list_head list;        /* in completion_chans */
+    int users;                    /* files and mappings on it, under completion_chans_lock */
+    unsigned int mode;            /* COMPLETION_MODE_*, under completion_chans_lock */
+    unsigned int reserve;         /* broadcast: head once the write in flight is done */
+    bool kernel_producer;         /* attached, under write_lock, see completion_chan_attach() */
+    atomic64_t counter;           /* counter and semaphore modes */
+    unsigned long prio_map;       /* priority: a bit for every level holding records */
+    unsigned int prio_head[COMPLETION_PRIO_LEVELS];
+    unsigned int prio_tail[COMPLETION_PRIO_LEVELS];
+    char *buf;                    /* data, right after the header page */
+    unsigned int size;            /* power of two, hdr->size is only a copy */
+    spinlock_t waiting_lock;      /* keeps the *_waiting flags exact */
+    int readers_waiting;
+    int writers_waiting;
+    struct mutex read_lock;
+    struct mutex write_lock;
+    wait_queue_head_t read_wait;  /* readers wait for data */
+    wait_queue_head_t write_wait; /* writers wait for space */
+    atomic64_t wakeups;           /* reader wakeups issued by writes */
+    atomic64_t wakeups_saved;     /* writes that did not wake readers */
+    atomic64_t timer_wakeups;     /* wakeups issued by a coalescing deadline */
+    atomic64_t overruns;          /* broadcast reads that lost data */
+    atomic64_t overrun_bytes;
+    u64 last_write_ns;            /* under write_lock */
+    u64 avg_gap_ns;               /* between writes, moving average */
+    atomic64_t spins;
+    atomic64_t spin_hits;
+    atomic64_t spin_ns;
+};
+
+/*
+ * per open file. A writer with coalescing on wakes readers once
+ * coalesce_bytes are pending, or coalesce_delay after the first
+ * write that did not wake them, whichever comes first.
+ */
+struct completion_file {
+    struct completion_chan *chan; /* fixed once chan_used is set */
+    struct mutex join_lock;       /* JOIN against the first use of chan */
+    bool chan_used;
+    unsigned int coalesce_bytes;  /* 0: wake on every write */
+    ktime_t coalesce_delay;       /* 0: no deadline */
+    atomic_t pending;             /* bytes written since the last wakeup */
+    struct hrtimer timer;
+    struct mutex cursor_lock;     /* broadcast: readers sharing this file */
+    unsigned int cursor;          /* broadcast: next byte this file reads */
+    u64 spin_max_ns;              /* 0: readers sleep right away */
+    long rcv_timeout;             /* jiffies, MAX_SCHEDULE_TIMEOUT: forever */
+    unsigned int prio;            /* priority: level of what this file writes */
+};
+
+static struct completion_chan comp; /* channel 0, lives as long as the module */
+static LIST_HEAD(completion_chans);
+static DEFINE_MUTEX(completion_chans_lock);
+
+/*
+ * bytes a consumer may read. A mapped header may hold anything, so
+ * never trust it beyond the size of the buffer.
+ */
+static unsigned int ring_used(struct completion_chan *chan)
+{
+    unsigned int used = smp_load_acquire(&chan->hdr->head) - READ_ONCE(chan->hdr->tail);
+
+    return min(used, chan->size);
+}
+
+/* bytes a producer may write */
+static unsigned int ring_free(struct completion_chan *chan)
+{
+    unsigned int used = READ_ONCE(chan->hdr->head) - smp_load_acquire(&chan->hdr->tail);
+
+    return chan->size - min(used, chan->size);
+}
+
+/*
+ * completion_set_waiting
+ * publish how many sleep on one side of the ring, so mmap peers know
+ * whether they have to ring the doorbell
+ */
+static void completion_set_waiting(struct completion_chan *chan, int *count,
+                                   __u32 *flag, int delta)
+{
+    spin_lock(&chan->waiting_lock);
+    *count += delta;
+    WRITE_ONCE(*flag, *count);
+    spin_unlock(&chan->waiting_lock);
+}
+
+/*
+ * completion_wait_data
+ * sleep until the ring holds data, for at most timeout jiffies. Returns
+ * what wait_event_interruptible_timeout() does: -ERESTARTSYS, 0 when
+ * the time ran out, the time left otherwise.
+ * The flag is set before the ring is checked, a producer publishes head
+ * before it checks the flag, so one of the two always sees the other.
+ */
+static long completion_wait_data(struct completion_chan *chan, long timeout)
+{
+    long ret;
+
+    completion_set_waiting(chan, &chan->readers_waiting, &chan->hdr->consumer_waiting, 1);
+    smp_mb();
+    ret = wait_event_interruptible_timeout(chan->read_wait, ring_used(chan) != 0, timeout);
+    completion_set_waiting(chan, &chan->readers_waiting, &chan->hdr->consumer_waiting, -1);
+    return ret;
+}
+
+/* sleep until the ring has room for need bytes */
+static int completion_wait_space(struct completion_chan *chan, unsigned int need)
+{
+    int ret;
+
+    completion_set_waiting(chan, &chan->writers_waiting, &chan->hdr->producer_waiting, 1);
+    smp_mb();
+    ret = wait_event_interruptible(chan->write_wait, ring_free(chan) >= need);
+    completion_set_waiting(chan, &chan->writers_waiting, &chan->hdr->producer_waiting, -1);
+    return ret;
+}
+
+/*
+ * copy len bytes starting at ring index out to user space,
+ * in two pieces when they wrap around the end of the buffer
+ */
+static int ring_copy_to_user(struct completion_chan *chan, char __user *buf,
+                             unsigned int index, unsigned int len)
+{
+    unsigned int off = index & (chan->size - 1);
+    unsigned int first = min(len, chan->size - off);
+
+    if (copy_to_user(buf, chan->buf + off, first))
+        return -EFAULT;
+    if (copy_to_user(buf + first, chan->buf, len - first))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+ * the same for read() and write(), whose iov_iter may as well be user
+ * memory as the pages of a pipe being spliced. buf and size are the
+ * whole ring, or one priority level of it.
+ */
+static int buf_copy_to_iter(char *buf, unsigned int size, struct iov_iter *to,
+                            unsigned int index, unsigned int len)
+{
+    unsigned int off = index & (size - 1);
+    unsigned int first = min(len, size - off);
+
+    if (copy_to_iter(buf + off, first, to) != first)
+        return -EFAULT;
+    if (copy_to_iter(buf, len - first, to) != len - first)
+        return -EFAULT;
+    return 0;
+}
+
+static int buf_copy_from_iter(char *buf, unsigned int size, unsigned int index,
+                              struct iov_iter *from, unsigned int len)
 {
-    printk(KERN_ERR "process %i (%s) going to sleep\n", current->pid, current->comm);
-    wait_for_completion(&comp);
-    if (copy_to_user(buf, &completion_buffer[read_index], count)) {
-        printk(KERN_ERR "copy_to_user failed\n");
+    unsigned int off = index & (size - 1);
+    unsigned int first = min(len, size - off);
+
+    if (copy_from_iter(buf + off, first, from) != first)
+        return -EFAULT;
+    if (copy_from_iter(buf, len - first, from) != len - first)
+        return -EFAULT;
+    return 0;
+}
+
+static int ring_copy_to_iter(struct completion_chan *chan, struct iov_iter *to,
+                             unsigned int index, unsigned int len)
+{
+    return buf_copy_to_iter(chan->buf, chan->size, to, index, len);
+}
+
+static int ring_copy_from_iter(struct completion_chan *chan, unsigned int index,
+                               struct iov_iter *from, unsigned int len)
+{
+    return buf_copy_from_iter(chan->buf, chan->size, index, from, len);
+}
+
+/*
+ * completion_file_chan
+ * the channel of cf, for anything but JOIN and per-file settings. From
+ * the first use on, a thread, a forked child or an epoll entry may hold
+ * on to the channel through this file, so cf stays on it for good.
+ */
+static struct completion_chan *completion_file_chan(struct completion_file *cf)
+{
+    if (unlikely(!smp_load_acquire(&cf->chan_used))) {
+        mutex_lock(&cf->join_lock);
+        smp_store_release(&cf->chan_used, true);
+        mutex_unlock(&cf->join_lock);
+    }
+    return cf->chan;
+}
+
+/* O_NONBLOCK on the file, or a caller such as io_uring that must not sleep */
+static bool completion_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Records: a u32 length, the data, and zeroes up to the next multiple
+ * of four. Records start four byte aligned and the ring size is a
+ * power of two, so a length never wraps around the end of the buffer.
+ */
+#define RECORD_HDR sizeof(u32)
+
+static unsigned int record_size(unsigned int len)
+{
+    return RECORD_HDR + ALIGN(len, 4);
+}
+
+/*
+ * whether a record of length len fits into the used bytes from its
+ * start on. The ring may have been mapped, so a length is never
+ * trusted beyond what is queued.
+ */
+static bool record_fits(u32 len, unsigned int used)
+{
+    return used >= RECORD_HDR && len <= used - RECORD_HDR && record_size(len) <= used;
+}
+
+/*
+ * ring_record_len
+ * the length of the record at index, of which used bytes are queued;
+ * -EIO if they cannot hold it
+ */
+static int ring_record_len(struct completion_chan *chan, unsigned int index,
+                           unsigned int used, u32 *len)
+{
+    if (index & (RECORD_HDR - 1))
+        return -EIO;
+    *len = *(u32 *)(chan->buf + (index & (chan->size - 1)));
+    return record_fits(*len, used) ? 0 : -EIO;
+}
+
+static enum hrtimer_restart completion_coalesce_timer(struct hrtimer *timer)
+{
+    struct completion_file *cf = container_of(timer, struct completion_file, timer);
+
+    atomic_set(&cf->pending, 0);
+    atomic64_inc(&cf->chan->timer_wakeups);
+    wake_up_interruptible(&cf->chan->read_wait);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * completion_wake_readers
+ * n more bytes are queued by cf, wake the readers now or let them sleep on
+ */
+static void completion_wake_readers(struct completion_file *cf, unsigned int n)
+{
+    struct completion_chan *chan = cf->chan;
+
+    if (atomic_add_return(n, &cf->pending) >= cf->coalesce_bytes) {
+        atomic_set(&cf->pending, 0);
+        hrtimer_try_to_cancel(&cf->timer);
+        atomic64_inc(&chan->wakeups);
+        wake_up_interruptible(&chan->read_wait);
+        return;
+    }
+
+    atomic64_inc(&chan->wakeups_saved);
+    if (cf->coalesce_delay && !hrtimer_active(&cf->timer))
+        hrtimer_start(&cf->timer, cf->coalesce_delay, HRTIMER_MODE_REL);
+}
+
+/*
+ * completion_flush_wakeup
+ * wake readers for whatever cf held back
+ */
+static void completion_flush_wakeup(struct completion_file *cf)
+{
+    if (atomic_xchg(&cf->pending, 0)) {
+        hrtimer_try_to_cancel(&cf->timer);
+        atomic64_inc(&cf->chan->wakeups);
+        wake_up_interruptible(&cf->chan->read_wait);
+    }
+}
+
+/*
+ * completion_read_broadcast
+ * like completion_read_iter, but from this file's own cursor, and nothing is
+ * consumed. Writers do not wait for us: if the bytes we copied may have
+ * been overwritten meanwhile, the read fails with -EOVERFLOW and the
+ * cursor moves on to the newest data.
+ */
+static ssize_t completion_read_broadcast(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = cf->chan;
+    size_t count = iov_iter_count(to);
+    unsigned int head;
+    unsigned int avail;
+    unsigned int lost;
+    long timeout = cf->rcv_timeout;
+    ssize_t ret;
+
+    if (mutex_lock_interruptible(&cf->cursor_lock))
+        return -ERESTARTSYS;
+
+    while ((head = smp_load_acquire(&chan->hdr->head)) == cf->cursor) {
+        mutex_unlock(&cf->cursor_lock);
+        if (completion_nowait(iocb))
+            return -EAGAIN;
+        timeout = wait_event_interruptible_timeout(chan->read_wait,
+                      READ_ONCE(chan->hdr->head) != READ_ONCE(cf->cursor), timeout);
+        if (timeout < 0)
+            return -ERESTARTSYS;
+        if (timeout == 0)
+            return -EAGAIN;
+        if (mutex_lock_interruptible(&cf->cursor_lock))
+            return -ERESTARTSYS;
+    }
+
+    avail = head - cf->cursor;
+    if (count > avail)
+        count = avail;
+    ret = count;
+    /* more than a ring behind is an overrun, nothing to copy */
+    if (avail <= chan->size && ring_copy_to_iter(chan, to, cf->cursor, count))
+        ret = -EFAULT;
+    /* the copy is done before we look at how far the writer got */
+    smp_rmb();
+    lost = READ_ONCE(chan->reserve) - cf->cursor;
+    /* head may have been moved through a stale mapping, not just by a write */
+    if (lost > chan->size || avail > chan->size) {
+        /* our oldest bytes were, or are being, overwritten */
+        head = READ_ONCE(chan->hdr->head);
+        atomic64_inc(&chan->overruns);
+        atomic64_add(head - cf->cursor, &chan->overrun_bytes);
+        WRITE_ONCE(cf->cursor, head);
+        ret = -EOVERFLOW;
+    } else if (ret > 0) {
+        trace_completion_read(current->pid, cf->cursor, count);
+        WRITE_ONCE(cf->cursor, cf->cursor + count);
+    }
+
+    mutex_unlock(&cf->cursor_lock);
+    return ret;
+}
+
+/*
+ * completion_note_write
+ * keep the moving average of the time between writes, under write_lock
+ */
+static void completion_note_write(struct completion_chan *chan)
+{
+    u64 now = ktime_get_ns();
+    u64 gap = now - chan->last_write_ns;
+    u64 avg = chan->avg_gap_ns;
+
+    if (chan->last_write_ns)
+        WRITE_ONCE(chan->avg_gap_ns, avg ? avg - avg / 8 + gap / 8 : gap);
+    chan->last_write_ns = now;
+}
+
+/*
+ * completion_spin
+ * poll the empty ring for a while before going to sleep, in the hope
+ * that a writer comes along first. Like adaptive mutex spinning, but
+ * we cannot see whether a writer is running, so guess from how far
+ * apart the recent writes were. Returns true if there is data.
+ */
+static bool completion_spin(struct completion_file *cf)
+{
+    struct completion_chan *chan = cf->chan;
+    u64 gap = READ_ONCE(chan->avg_gap_ns);
+    u64 start, now, budget;
+    bool hit = false;
+
+    if (!cf->spin_max_ns || !gap || gap > cf->spin_max_ns)
+        return false;
+    budget = min(2 * gap, cf->spin_max_ns);
+
+    start = now = ktime_get_ns();
+    while (now - start < budget) {
+        if (ring_used(chan)) {
+            hit = true;
+            break;
+        }
+        if (need_resched() || signal_pending(current))
+            break;
+        cpu_relax();
+        now = ktime_get_ns();
+    }
+
+    atomic64_inc(&chan->spins);
+    if (hit)
+        atomic64_inc(&chan->spin_hits);
+    atomic64_add(ktime_get_ns() - start, &chan->spin_ns);
+    return hit;
+}
+
+/*
+ * completion_lock_data
+ * take read_lock with data in the ring, sleeping for it if need be.
+ * Returns the number of bytes there, or an error without the lock.
+ */
+static int completion_lock_data(struct completion_file *cf, bool nowait)
+{
+    struct completion_chan *chan = cf->chan;
+    long timeout = cf->rcv_timeout;
+    unsigned int avail;
+
+    if (mutex_lock_interruptible(&chan->read_lock))
+        return -ERESTARTSYS;
+
+    while ((avail = ring_used(chan)) == 0) {
+        mutex_unlock(&chan->read_lock);
+        if (nowait)
+            return -EAGAIN;
+        if (completion_spin(cf))
+            goto relock;
+        trace_completion_read_sleep(current->pid, READ_ONCE(chan->hdr->head),
+                                    READ_ONCE(chan->hdr->tail));
+        timeout = completion_wait_data(chan, timeout);
+        if (timeout < 0)
+            return -ERESTARTSYS;
+        if (timeout == 0)
+            return -EAGAIN;
+        trace_completion_read_wake(current->pid, READ_ONCE(chan->hdr->head),
+                                   READ_ONCE(chan->hdr->tail));
+relock:
+        if (mutex_lock_interruptible(&chan->read_lock))
+            return -ERESTARTSYS;
+    }
+    return avail;
+}
+
+/*
+ * completion_read_record
+ * one whole record, or -EMSGSIZE if it does not fit into to.
+ * Called with read_lock held and avail bytes in the ring.
+ */
+static ssize_t completion_read_record(struct completion_chan *chan, struct iov_iter *to,
+                                      unsigned int avail)
+{
+    unsigned int tail = chan->hdr->tail;
+    u32 len;
+
+    if (ring_record_len(chan, tail, avail, &len))
+        return -EIO;
+    if (len > iov_iter_count(to))
+        return -EMSGSIZE;
+    if (ring_copy_to_iter(chan, to, tail + RECORD_HDR, len))
+        return -EFAULT;
+    trace_completion_read(current->pid, tail, len);
+    smp_store_release(&chan->hdr->tail, tail + record_size(len));
+    wake_up_interruptible(&chan->write_wait);
+    return len;
+}
+
+/*
+ * completion_recv_batch
+ * COMPLETION_IOC_RECV_BATCH: as many whole records as fit, in their ring
+ * format, with one copy (two at the wrap)
+ */
+static int completion_recv_batch(struct file *filp, struct completion_batch __user *ub)
+{
+    struct completion_file *cf = filp->private_data;
+    struct completion_chan *chan = cf->chan;
+    struct completion_batch b;
+    unsigned int tail, bytes, rec;
+    u32 len;
+    int avail;
+    int ret = 0;
+
+    if (chan->mode != COMPLETION_MODE_RECORD)
+        return -EINVAL;
+    if (copy_from_user(&b, ub, sizeof(b)))
+        return -EFAULT;
+    if (b.max_msgs == 0)
+        return -EINVAL;
+
+    avail = completion_lock_data(cf, filp->f_flags & O_NONBLOCK);
+    if (avail < 0)
+        return avail;
+
+    tail = chan->hdr->tail;
+    b.msgs = 0;
+    for (bytes = 0; bytes < avail && b.msgs < b.max_msgs; bytes += rec, b.msgs++) {
+        if (ring_record_len(chan, tail + bytes, avail - bytes, &len)) {
+            /* a mangled record: hand out the ones before it, the next call fails */
+            if (b.msgs == 0) {
+                ret = -EIO;
+                goto out;
+            }
+            break;
+        }
+        rec = record_size(len);
+        if (bytes + rec > b.buf_len)
+            break;
+    }
+    if (b.msgs == 0) {
+        /* not even the first record fits */
+        ret = -EMSGSIZE;
+        goto out;
+    }
+    if (ring_copy_to_user(chan, u64_to_user_ptr(b.buf), tail, bytes)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    trace_completion_read(current->pid, tail, bytes);
+    smp_store_release(&chan->hdr->tail, tail + bytes);
+    wake_up_interruptible(&chan->write_wait);
+
+    b.bytes = bytes;
+    if (copy_to_user(ub, &b, sizeof(b)))
+        ret = -EFAULT;
+    else
+        ret = b.msgs;
+out:
+    mutex_unlock(&chan->read_lock);
+    return ret;
+}
+
+static bool completion_counter_mode(struct completion_chan *chan)
+{
+    return chan->mode == COMPLETION_MODE_COUNTER || chan->mode == COMPLETION_MODE_SEMAPHORE;
+}
+
+/*
+ * completion_read_counter
+ * sleep until the counter is non-zero, then take all of it, or just one
+ * in semaphore mode. A single atomic op on the fast path.
+ */
+static ssize_t completion_read_counter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = cf->chan;
+    long timeout = cf->rcv_timeout;
+    u64 value;
+
+    if (iov_iter_count(to) < sizeof(value))
+        return -EINVAL;
+
+    for (;;) {
+        if (chan->mode == COMPLETION_MODE_SEMAPHORE) {
+            value = 1;
+            if (atomic64_add_unless(&chan->counter, -1, 0))
+                break;
+        } else {
+            value = atomic64_xchg(&chan->counter, 0);
+            if (value)
+                break;
+        }
+        if (completion_nowait(iocb))
+            return -EAGAIN;
+        timeout = wait_event_interruptible_timeout(chan->read_wait,
+                      atomic64_read(&chan->counter) != 0, timeout);
+        if (timeout < 0)
+            return -ERESTARTSYS;
+        if (timeout == 0)
+            return -EAGAIN;
+    }
+
+    if (copy_to_iter(&value, sizeof(value), to) != sizeof(value)) {
+        /* nobody saw it, so put it back */
+        atomic64_add(value, &chan->counter);
+        return -EFAULT;
+    }
+    return sizeof(value);
+}
+
+/*
+ * completion_write_counter
+ * add a __u64 to the counter. Like an eventfd it tops out at 2^64 - 2,
+ * but we fail with -EOVERFLOW there instead of sleeping.
+ */
+static ssize_t completion_write_counter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = cf->chan;
+    u64 value;
+    s64 old;
+
+    if (iov_iter_count(from) < sizeof(value))
+        return -EINVAL;
+    if (copy_from_iter(&value, sizeof(value), from) != sizeof(value))
+        return -EFAULT;
+    if (value == U64_MAX)
+        return -EINVAL;
+
+    old = atomic64_read(&chan->counter);
+    do {
+        if (value > U64_MAX - 1 - (u64)old)
+            return -EOVERFLOW;
+    } while (!atomic64_try_cmpxchg(&chan->counter, &old, old + value));
+
+    if (value && wq_has_sleeper(&chan->read_wait)) {
+        atomic64_inc(&chan->wakeups);
+        wake_up_interruptible(&chan->read_wait);
     } else {
-        read_index += count;
-        if (read_index >= BUFFER_SIZE) {
-            read_index %= BUFFER_SIZE;
+        atomic64_inc(&chan->wakeups_saved);
+    }
+    return sizeof(value);
+}
+
+/*
+ * Priority mode: level l is the l-th COMPLETION_PRIO_LEVELS part of
+ * the ring, with a head and tail of its own and records in it as in
+ * record mode. A level's bit in prio_map is set by the writer after it
+ * publishes head, and cleared by the reader, under read_lock, when it
+ * takes the last record. A level with records always has its bit set,
+ * but the writer's set_bit() can land after the reader has drained the
+ * level and cleared it, so a set bit may also mean an empty level: the
+ * reader checks head against tail, and clears a stale bit again.
+ */
+static unsigned int prio_size(struct completion_chan *chan)
+{
+    return chan->size / COMPLETION_PRIO_LEVELS;
+}
+
+static char *prio_buf(struct completion_chan *chan, unsigned int level)
+{
+    return chan->buf + level * prio_size(chan);
+}
+
+static unsigned int prio_free(struct completion_chan *chan, unsigned int level)
+{
+    unsigned int used = READ_ONCE(chan->prio_head[level]) -
+                        smp_load_acquire(&chan->prio_tail[level]);
+
+    return prio_size(chan) - min(used, prio_size(chan));
+}
+
+/* the highest level whose bit is set, -1 if there is none */
+static int prio_level(struct completion_chan *chan)
+{
+    unsigned long map = READ_ONCE(chan->prio_map);
+
+    return map ? __fls(map) : -1;
+}
+
+/*
+ * prio_clear
+ * level looks empty at tail, clear its bit unless a writer published
+ * head meanwhile. Under read_lock.
+ */
+static void prio_clear(struct completion_chan *chan, unsigned int level, unsigned int tail)
+{
+    clear_bit(level, &chan->prio_map);
+    /* a writer that published head before we cleared the bit wants it back */
+    smp_mb__after_atomic();
+    if (smp_load_acquire(&chan->prio_head[level]) != tail)
+        set_bit(level, &chan->prio_map);
+}
+
+/* whether any level really holds records, not just its bit */
+static bool prio_readable(struct completion_chan *chan)
+{
+    unsigned long map = READ_ONCE(chan->prio_map);
+    unsigned int level;
+
+    for_each_set_bit(level, &map, COMPLETION_PRIO_LEVELS) {
+        if (smp_load_acquire(&chan->prio_head[level]) != READ_ONCE(chan->prio_tail[level]))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * completion_read_prio
+ * the oldest record of the highest level, or -EMSGSIZE if it does not
+ * fit into to. Finding it is one find-last-bit, however much lower
+ * priority traffic is queued.
+ */
+static ssize_t completion_read_prio(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = cf->chan;
+    long timeout = cf->rcv_timeout;
+    unsigned int head, tail, mask;
+    char *buf;
+    ssize_t ret;
+    int level;
+    u32 len;
+
+    if (mutex_lock_interruptible(&chan->read_lock))
+        return -ERESTARTSYS;
+
+    for (;;) {
+        while ((level = prio_level(chan)) < 0) {
+            mutex_unlock(&chan->read_lock);
+            if (completion_nowait(iocb))
+                return -EAGAIN;
+            timeout = wait_event_interruptible_timeout(chan->read_wait,
+                          READ_ONCE(chan->prio_map) != 0, timeout);
+            if (timeout < 0)
+                return -ERESTARTSYS;
+            if (timeout == 0)
+                return -EAGAIN;
+            if (mutex_lock_interruptible(&chan->read_lock))
+                return -ERESTARTSYS;
         }
+        tail = chan->prio_tail[level];
+        /* acquire: the record is complete before head moves past it */
+        head = smp_load_acquire(&chan->prio_head[level]);
+        if (head != tail)
+            break;
+        /* a stale bit, set after we drained the level: look again */
+        prio_clear(chan, level, tail);
+    }
+
+    buf = prio_buf(chan, level);
+    mask = prio_size(chan) - 1;
+    len = *(u32 *)(buf + (tail & mask));
+    /* never past what the level holds, whatever the ring says */
+    if (!record_fits(len, head - tail)) {
+        ret = -EIO;
+        goto out;
+    }
+    if (len > iov_iter_count(to)) {
+        ret = -EMSGSIZE;
+        goto out;
+    }
+    if (buf_copy_to_iter(buf, prio_size(chan), to, tail + RECORD_HDR, len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    trace_completion_read(current->pid, tail, len);
+    tail += record_size(len);
+    smp_store_release(&chan->prio_tail[level], tail);
+    if (tail == head)
+        prio_clear(chan, level, tail);
+    ret = len;
+    wake_up_interruptible(&chan->write_wait);
+out:
+    mutex_unlock(&chan->read_lock);
+    return ret;
+}
+
+/*
+ * completion_write_prio
+ * queue from as one record at cf's level. Writers sleep for room
+ * without write_lock, so one stuck behind a full bulk level does not
+ * hold up an urgent one.
+ */
+static ssize_t completion_write_prio(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = cf->chan;
+    size_t count = iov_iter_count(from);
+    unsigned int level = cf->prio;
+    unsigned int mask = prio_size(chan) - 1;
+    char *buf = prio_buf(chan, level);
+    unsigned int head, need, i;
+
+    if (count > prio_size(chan) - RECORD_HDR)
+        return -EMSGSIZE;
+    need = record_size(count);
+
+    for (;;) {
+        if (mutex_lock_interruptible(&chan->write_lock))
+            return -ERESTARTSYS;
+        if (prio_free(chan, level) >= need)
+            break;
+        mutex_unlock(&chan->write_lock);
+        completion_flush_wakeup(cf);
+        if (completion_nowait(iocb))
+            return -EAGAIN;
+        if (wait_event_interruptible(chan->write_wait, prio_free(chan, level) >= need))
+            return -ERESTARTSYS;
+    }
+    completion_note_write(chan);
+
+    head = chan->prio_head[level];
+    *(u32 *)(buf + (head & mask)) = count;
+    if (buf_copy_from_iter(buf, prio_size(chan), head + RECORD_HDR, from, count)) {
+        mutex_unlock(&chan->write_lock);
+        return -EFAULT;
     }
-    printk(KERN_ERR "awoken %i (%s)\n", current->pid, current->comm);
+    for (i = RECORD_HDR + count; i < need; i++)
+        buf[(head + i) & mask] = 0;
+    smp_store_release(&chan->prio_head[level], head + need);
+    set_bit(level, &chan->prio_map);
+    mutex_unlock(&chan->write_lock);
+
+    trace_completion_write(current->pid, head, count);
+    completion_wake_readers(cf, need);
     return count;
 }
 
-ssize_t completion_write(struct file *filp, const char __user *buf, size_t count, loff_t *pos)
+/*
+ * completion_read_iter
+ * sleep until the ring holds data, then return what is there, at most
+ * as much as fits into to. Also what splice() reads through.
+ */
+static ssize_t completion_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = completion_file_chan(cf);
+    size_t count = iov_iter_count(to);
+    int avail;
+    ssize_t ret;
+
+    if (completion_counter_mode(chan))
+        return completion_read_counter(iocb, to);
+    if (chan->mode == COMPLETION_MODE_PRIORITY)
+        return completion_read_prio(iocb, to);
+    if (count == 0 && chan->mode != COMPLETION_MODE_RECORD)
+        return 0;
+    if (chan->mode == COMPLETION_MODE_BROADCAST)
+        return completion_read_broadcast(iocb, to);
+
+    avail = completion_lock_data(cf, completion_nowait(iocb));
+    if (avail < 0)
+        return avail;
+    if (chan->mode == COMPLETION_MODE_RECORD) {
+        ret = completion_read_record(chan, to, avail);
+        goto out;
+    }
+
+    if (count > avail)
+        count = avail;
+    if (ring_copy_to_iter(chan, to, chan->hdr->tail, count)) {
+        printk(KERN_ERR "copy_to_iter failed\n");
+        ret = -EFAULT;
+        goto out;
+    }
+    trace_completion_read(current->pid, chan->hdr->tail, count);
+    /* release: the copy above is done before a writer may reuse the space */
+    smp_store_release(&chan->hdr->tail, chan->hdr->tail + count);
+    wake_up_interruptible(&chan->write_wait);
+    ret = count;
+
+out:
+    mutex_unlock(&chan->read_lock);
+    return ret;
+}
+
+/*
+ * completion_write_record
+ * queue all of from as one record, waiting until it fits.
+ * Called with write_lock held.
+ */
+static ssize_t completion_write_record(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = cf->chan;
+    size_t count = iov_iter_count(from);
+    unsigned int head = chan->hdr->head;
+    unsigned int need, i;
+
+    if (count > chan->size - RECORD_HDR)
+        return -EMSGSIZE;
+    need = record_size(count);
+
+    while (ring_free(chan) < need) {
+        completion_flush_wakeup(cf);
+        if (completion_nowait(iocb))
+            return -EAGAIN;
+        trace_completion_write_sleep(current->pid, head, READ_ONCE(chan->hdr->tail));
+        if (completion_wait_space(chan, need))
+            return -ERESTARTSYS;
+    }
+
+    *(u32 *)(chan->buf + (head & (chan->size - 1))) = count;
+    if (ring_copy_from_iter(chan, head + RECORD_HDR, from, count))
+        return -EFAULT;
+    /* do not hand out what earlier records left in the padding */
+    for (i = RECORD_HDR + count; i < need; i++)
+        chan->buf[(head + i) & (chan->size - 1)] = 0;
+    /* release: readers see the whole record before they see the new head */
+    smp_store_release(&chan->hdr->head, head + need);
+
+    trace_completion_write(current->pid, head, count);
+    completion_wake_readers(cf, need);
+    return count;
+}
+
+/*
+ * completion_write_iter
+ * queue all of from, sleeping whenever the ring is full. With
+ * O_NONBLOCK, queue what fits and fail with -EAGAIN if nothing did.
+ * Also what splice() writes through.
+ */
+static ssize_t completion_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct completion_file *cf = iocb->ki_filp->private_data;
+    struct completion_chan *chan = completion_file_chan(cf);
+    size_t count = iov_iter_count(from);
+    size_t done = 0;
+    unsigned int space;
+    unsigned int n;
+    ssize_t ret = 0;
+
+    if (completion_counter_mode(chan))
+        return completion_write_counter(iocb, from);
+    if (chan->mode == COMPLETION_MODE_PRIORITY)
+        return completion_write_prio(iocb, from);
+    if (mutex_lock_interruptible(&chan->write_lock))
+        return -ERESTARTSYS;
+    /* the kernel producer writes without taking write_lock */
+    if (chan->kernel_producer) {
+        mutex_unlock(&chan->write_lock);
+        return -EBUSY;
+    }
+    completion_note_write(chan);
+
+    if (chan->mode == COMPLETION_MODE_RECORD) {
+        ret = completion_write_record(iocb, from);
+        mutex_unlock(&chan->write_lock);
+        return ret;
+    }
+
+    while (done < count) {
+        if (chan->mode == COMPLETION_MODE_BROADCAST) {
+            /*
+             * overwrite the oldest bytes, a ring at a time; reserve
+             * tells readers which bytes we are about to clobber
+             */
+            n = min_t(size_t, count - done, chan->size);
+            WRITE_ONCE(chan->reserve, chan->hdr->head + n);
+            smp_wmb();
+            if (ring_copy_from_iter(chan, chan->hdr->head, from, n)) {
+                ret = -EFAULT;
+                break;
+            }
+            smp_store_release(&chan->hdr->head, chan->hdr->head + n);
+            done += n;
+            trace_completion_write(current->pid, chan->hdr->head - n, n);
+            completion_wake_readers(cf, n);
+            continue;
+        }
+
+        space = ring_free(chan);
+        if (space == 0) {
+            /* a full ring must never wait on readers we did not wake */
+            completion_flush_wakeup(cf);
+            if (completion_nowait(iocb)) {
+                ret = -EAGAIN;
+                break;
+            }
+            trace_completion_write_sleep(current->pid, chan->hdr->head,
+                                         READ_ONCE(chan->hdr->tail));
+            if (completion_wait_space(chan, 1)) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        n = min_t(size_t, count - done, space);
+        if (ring_copy_from_iter(chan, chan->hdr->head, from, n)) {
+            printk(KERN_ERR "copy_from_iter failed\n");
+            ret = -EFAULT;
+            break;
+        }
+        /* release: readers see the data before they see the new head */
+        smp_store_release(&chan->hdr->head, chan->hdr->head + n);
+        done += n;
+
+        trace_completion_write(current->pid, chan->hdr->head - n, n);
+        completion_wake_readers(cf, n);
+    }
+
+    mutex_unlock(&chan->write_lock);
+    return done ? done : ret;
+}
+
+static int completion_chan_init(struct completion_chan *chan, unsigned int size)
+{
+    size = roundup_pow_of_two(clamp_t(unsigned int, size, RING_SIZE_MIN, RING_SIZE_MAX));
+    /* zeroed and mappable, the header page comes first */
+    chan->hdr = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(size));
+    if (!chan->hdr)
+        return -ENOMEM;
+    chan->buf = (char *)chan->hdr + PAGE_SIZE;
+    chan->size = size;
+    chan->hdr->size = size;
+    chan->hdr->data_offset = PAGE_SIZE;
+    chan->mode = COMPLETION_MODE_STREAM;
+    chan->reserve = 0;
+    chan->users = 0;
+    chan->kernel_producer = false;
+    atomic64_set(&chan->counter, 0);
+    chan->prio_map = 0;
+    memset(chan->prio_head, 0, sizeof(chan->prio_head));
+    memset(chan->prio_tail, 0, sizeof(chan->prio_tail));
+    spin_lock_init(&chan->waiting_lock);
+    chan->readers_waiting = 0;
+    chan->writers_waiting = 0;
+    mutex_init(&chan->read_lock);
+    mutex_init(&chan->write_lock);
+    init_waitqueue_head(&chan->read_wait);
+    init_waitqueue_head(&chan->write_wait);
+    atomic64_set(&chan->wakeups, 0);
+    atomic64_set(&chan->wakeups_saved, 0);
+    atomic64_set(&chan->timer_wakeups, 0);
+    atomic64_set(&chan->overruns, 0);
+    atomic64_set(&chan->overrun_bytes, 0);
+    chan->last_write_ns = 0;
+    chan->avg_gap_ns = 0;
+    atomic64_set(&chan->spins, 0);
+    atomic64_set(&chan->spin_hits, 0);
+    atomic64_set(&chan->spin_ns, 0);
+    return 0;
+}
+
+static struct completion_chan *completion_chan_create(const struct completion_channel *id)
+{
+    struct completion_chan *chan;
+
+    chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+    if (!chan)
+        return NULL;
+    if (completion_chan_init(chan, ring_size)) {
+        kfree(chan);
+        return NULL;
+    }
+    chan->id = *id;
+    list_add(&chan->list, &completion_chans);
+    return chan;
+}
+
+static struct completion_chan *completion_chan_find(const struct completion_channel *id)
+{
+    struct completion_chan *chan;
+
+    list_for_each_entry(chan, &completion_chans, list) {
+        if (chan->id.id == id->id && !strcmp(chan->id.name, id->name))
+            return chan;
+    }
+    return NULL;
+}
+
+/*
+ * completion_chan_enter, completion_chan_leave
+ * move cf onto or off a channel, under completion_chans_lock
+ */
+static void completion_chan_enter(struct completion_file *cf, struct completion_chan *chan)
+{
+    chan->users++;
+    cf->chan = chan;
+    /* a subscriber sees what is written from now on */
+    cf->cursor = READ_ONCE(chan->hdr->head);
+}
+
+/* drop a user of chan, freeing it with the last one unless it is channel 0 */
+static void completion_chan_put(struct completion_chan *chan)
+{
+    if (--chan->users)
+        return;
+    if (chan == &comp) {
+        if (chan->mode != COMPLETION_MODE_STREAM) {
+            chan->mode = COMPLETION_MODE_STREAM;
+            chan->hdr->tail = chan->hdr->head;
+        }
+        return;
+    }
+    list_del(&chan->list);
+    vfree(chan->hdr);
+    kfree(chan);
+}
+
+static void completion_chan_leave(struct completion_file *cf)
+{
+    completion_chan_put(cf->chan);
+}
+
+/*
+ * completion_join
+ * move cf to the channel id, creating it if nobody is on it yet. Only
+ * before cf has used its channel (completion_file_chan()): leaving may
+ * free the old one, and nothing may hold on to it then.
+ */
+static int completion_join(struct completion_file *cf, const struct completion_channel *id)
+{
+    struct completion_chan *chan;
+    int ret = 0;
+
+    mutex_lock(&cf->join_lock);
+    if (cf->chan_used) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    mutex_lock(&completion_chans_lock);
+    chan = completion_chan_find(id);
+    if (!chan)
+        chan = completion_chan_create(id);
+    if (!chan) {
+        ret = -ENOMEM;
+    } else if (chan != cf->chan) {
+        chan->users++;     /* so leaving cannot free it */
+        completion_chan_leave(cf);
+        completion_chan_enter(cf, chan);
+        chan->users--;
+    }
+    mutex_unlock(&completion_chans_lock);
+out:
+    mutex_unlock(&cf->join_lock);
+    return ret;
+}
+
+/*
+ * In-kernel producers, declared in completion_test.h.
+ *
+ * completion_chan_attach
+ * make the caller the producer of channel id, creating it if need be.
+ * Process context only, and it may sleep until a write() in progress
+ * is done. The channel must be in stream mode, stays in it while
+ * attached, and write() on it fails with -EBUSY meanwhile; producers
+ * through a mapping of the ring are not kept out (completion_test.h).
+ */
+struct completion_chan *completion_chan_attach(const struct completion_channel *id)
+{
+    struct completion_chan *chan;
+    int err = 0;
+
+    mutex_lock(&completion_chans_lock);
+    chan = completion_chan_find(id);
+    if (!chan)
+        chan = completion_chan_create(id);
+    if (!chan)
+        err = -ENOMEM;
+    else if (chan->mode != COMPLETION_MODE_STREAM)
+        err = -EINVAL;
+    if (err) {
+        mutex_unlock(&completion_chans_lock);
+        return ERR_PTR(err);
+    }
+    /* a user like any open file, so the mode cannot change under us */
+    chan->users++;
+    mutex_unlock(&completion_chans_lock);
+
+    /* write() checks the flag under write_lock, so none is left in flight */
+    mutex_lock(&chan->write_lock);
+    if (chan->kernel_producer)
+        err = -EBUSY;
+    else
+        chan->kernel_producer = true;
+    mutex_unlock(&chan->write_lock);
+    if (err) {
+        mutex_lock(&completion_chans_lock);
+        completion_chan_put(chan);
+        mutex_unlock(&completion_chans_lock);
+        return ERR_PTR(err);
+    }
+    return chan;
+}
+EXPORT_SYMBOL(completion_chan_attach);
+
+void completion_chan_detach(struct completion_chan *chan)
+{
+    mutex_lock(&chan->write_lock);
+    chan->kernel_producer = false;
+    mutex_unlock(&chan->write_lock);
+
+    mutex_lock(&completion_chans_lock);
+    completion_chan_put(chan);
+    mutex_unlock(&completion_chans_lock);
+}
+EXPORT_SYMBOL(completion_chan_detach);
+
+/*
+ * completion_chan_reserve
+ * room for up to len bytes at the head of the ring, to be filled in
+ * place and published with completion_chan_commit(). *got is what is
+ * contiguous and free, possibly less than len; NULL if the ring is
+ * full. Takes no locks and never sleeps, so it is fine in IRQ context,
+ * as long as the caller is the only one producing at a time.
+ */
+void *completion_chan_reserve(struct completion_chan *chan, unsigned int len, unsigned int *got)
 {
-    if (copy_from_user(&completion_buffer[write_index], buf, count)) {
-        printk(KERN_ERR "copy_from_user failed\n");
+    unsigned int head = chan->hdr->head;
+    unsigned int off = head & (chan->size - 1);
+
+    *got = min3(len, ring_free(chan), chan->size - off);
+    return *got ? chan->buf + off : NULL;
+}
+EXPORT_SYMBOL(completion_chan_reserve);
+
+/*
+ * completion_chan_commit
+ * publish len bytes of the last reservation and wake the readers
+ */
+void completion_chan_commit(struct completion_chan *chan, unsigned int len)
+{
+    unsigned int head = chan->hdr->head;
+
+    /* release: readers see the data before they see the new head */
+    smp_store_release(&chan->hdr->head, head + len);
+    trace_completion_write(current->pid, head, len);
+    /* wq_has_sleeper() has the barrier that pairs with completion_wait_data() */
+    if (wq_has_sleeper(&chan->read_wait)) {
+        atomic64_inc(&chan->wakeups);
+        wake_up_interruptible(&chan->read_wait);
     } else {
-        write_index += count;
-        if (write_index >= BUFFER_SIZE) {
-            write_index %= BUFFER_SIZE;
+        atomic64_inc(&chan->wakeups_saved);
+    }
+}
+EXPORT_SYMBOL(completion_chan_commit);
+
+static long completion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct completion_file *cf = filp->private_data;
+    struct completion_chan *chan = NULL;
+    struct completion_coalesce co;
+    struct completion_stats st;
+    struct completion_channel id;
+    struct completion_spin sp;
+    struct completion_timeout to;
+
+    switch (cmd) {
+    case COMPLETION_IOC_JOIN:
+    case COMPLETION_IOC_SET_COALESCE:
+    case COMPLETION_IOC_SET_SPIN:
+    case COMPLETION_IOC_SET_TIMEOUT:
+    case COMPLETION_IOC_SET_PRIO:
+        break;
+    default:
+        chan = completion_file_chan(cf);
+        break;
+    }
+
+    switch (cmd) {
+    case COMPLETION_IOC_SET_COALESCE:
+        if (copy_from_user(&co, (void __user *)arg, sizeof(co)))
+            return -EFAULT;
+        cf->coalesce_bytes = co.bytes;
+        cf->coalesce_delay = ns_to_ktime((u64)co.usecs * NSEC_PER_USEC);
+        return 0;
+
+    case COMPLETION_IOC_SET_SPIN:
+        if (copy_from_user(&sp, (void __user *)arg, sizeof(sp)))
+            return -EFAULT;
+        cf->spin_max_ns = (u64)sp.max_usecs * NSEC_PER_USEC;
+        return 0;
+
+    case COMPLETION_IOC_GET_STATS:
+        memset(&st, 0, sizeof(st));
+        st.wakeups = atomic64_read(&chan->wakeups);
+        st.wakeups_saved = atomic64_read(&chan->wakeups_saved);
+        st.timer_wakeups = atomic64_read(&chan->timer_wakeups);
+        st.overruns = atomic64_read(&chan->overruns);
+        st.overrun_bytes = atomic64_read(&chan->overrun_bytes);
+        st.spins = atomic64_read(&chan->spins);
+        st.spin_hits = atomic64_read(&chan->spin_hits);
+        st.spin_ns = atomic64_read(&chan->spin_ns);
+        if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+            return -EFAULT;
+        return 0;
+
+    case COMPLETION_IOC_DOORBELL:
+        if (arg == COMPLETION_RING_DATA) {
+            atomic64_inc(&chan->wakeups);
+            wake_up_interruptible(&chan->read_wait);
+        } else if (arg == COMPLETION_RING_SPACE) {
+            wake_up_interruptible(&chan->write_wait);
+        } else {
+            return -EINVAL;
+        }
+        return 0;
+
+    case COMPLETION_IOC_SET_MODE:
+        if (arg > COMPLETION_MODE_PRIORITY)
+            return -EINVAL;
+        mutex_lock(&completion_chans_lock);
+        if (chan->users != 1) {
+            /* others may be sleeping, copying or mapped under the old rules */
+            mutex_unlock(&completion_chans_lock);
+            return -EBUSY;
         }
+        chan->mode = arg;
+        /* start out empty, whichever way the ring is read, and aligned for records */
+        chan->hdr->head = ALIGN(chan->hdr->head, 4);
+        chan->hdr->tail = chan->hdr->head;
+        chan->reserve = chan->hdr->head;
+        cf->cursor = chan->hdr->head;
+        atomic64_set(&chan->counter, 0);
+        chan->prio_map = 0;
+        memset(chan->prio_head, 0, sizeof(chan->prio_head));
+        memset(chan->prio_tail, 0, sizeof(chan->prio_tail));
+        mutex_unlock(&completion_chans_lock);
+        return 0;
+
+    case COMPLETION_IOC_JOIN:
+        if (copy_from_user(&id, (void __user *)arg, sizeof(id)))
+            return -EFAULT;
+        if (strnlen(id.name, sizeof(id.name)) == sizeof(id.name))
+            return -EINVAL;
+        return completion_join(cf, &id);
+
+    case COMPLETION_IOC_SET_TIMEOUT:
+        if (copy_from_user(&to, (void __user *)arg, sizeof(to)))
+            return -EFAULT;
+        cf->rcv_timeout = to.msecs ? msecs_to_jiffies(to.msecs) : MAX_SCHEDULE_TIMEOUT;
+        return 0;
+
+    case COMPLETION_IOC_SET_PRIO:
+        if (arg >= COMPLETION_PRIO_LEVELS)
+            return -EINVAL;
+        cf->prio = arg;
+        return 0;
+
+    case COMPLETION_IOC_RECV_BATCH:
+        return completion_recv_batch(filp, (struct completion_batch __user *)arg);
+
+    case COMPLETION_IOC_WAIT:
+        if (chan->mode != COMPLETION_MODE_STREAM)
+            return -EINVAL;
+        if (arg == COMPLETION_RING_DATA)
+            return completion_wait_data(chan, MAX_SCHEDULE_TIMEOUT) < 0 ? -ERESTARTSYS : 0;
+        if (arg == COMPLETION_RING_SPACE)
+            return completion_wait_space(chan, 1) ? -ERESTARTSYS : 0;
+        return -EINVAL;
     }
-    printk(KERN_ERR "process %i (%s) awakening the readers...\n", current->pid, current->comm);
-    complete(&comp);
-    return count;
+
+    return -ENOTTY;
+}
+
+/*
+ * completion_poll
+ * readable when this file would get data without sleeping, writable
+ * when a write would queue something. In broadcast mode writers never
+ * wait. Waiters are woken by write(), read() and the doorbell ioctl, not
+ * by peers that move head or tail through a mapping without it.
+ */
+static __poll_t completion_poll(struct file *filp, poll_table *wait)
+{
+    struct completion_file *cf = filp->private_data;
+    struct completion_chan *chan = completion_file_chan(cf);
+    __poll_t mask = 0;
+
+    poll_wait(filp, &chan->read_wait, wait);
+    poll_wait(filp, &chan->write_wait, wait);
+
+    switch (chan->mode) {
+    case COMPLETION_MODE_COUNTER:
+    case COMPLETION_MODE_SEMAPHORE:
+        if (atomic64_read(&chan->counter))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        /* room for at least a 1 */
+        if ((u64)atomic64_read(&chan->counter) < U64_MAX - 1)
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        break;
+    case COMPLETION_MODE_PRIORITY:
+        if (prio_readable(chan))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (prio_free(chan, cf->prio) >= RECORD_HDR)
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        break;
+    case COMPLETION_MODE_BROADCAST:
+        if (READ_ONCE(chan->hdr->head) != READ_ONCE(cf->cursor))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        mask |= EPOLLOUT | EPOLLWRNORM;
+        break;
+    case COMPLETION_MODE_RECORD:
+        if (ring_used(chan))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        /* room for at least an empty record */
+        if (ring_free(chan) >= RECORD_HDR)
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        break;
+    default:
+        if (ring_used(chan))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (ring_free(chan))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        break;
+    }
+    return mask;
+}
+
+/*
+ * a mapping is a user of the channel like an open file, so the ring
+ * cannot change its mode under it, nor go away before it
+ */
+static void completion_vm_open(struct vm_area_struct *vma)
+{
+    struct completion_chan *chan = vma->vm_private_data;
+
+    mutex_lock(&completion_chans_lock);
+    chan->users++;
+    mutex_unlock(&completion_chans_lock);
+}
+
+static void completion_vm_close(struct vm_area_struct *vma)
+{
+    mutex_lock(&completion_chans_lock);
+    completion_chan_put(vma->vm_private_data);
+    mutex_unlock(&completion_chans_lock);
+}
+
+static const struct vm_operations_struct completion_vm_ops = {
+    .open  = completion_vm_open,
+    .close = completion_vm_close,
+};
+
+/*
+ * completion_mmap
+ * the header page followed by the data, see struct completion_ring_hdr
+ */
+static int completion_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct completion_file *cf = filp->private_data;
+    struct completion_chan *chan = completion_file_chan(cf);
+    int ret;
+
+    mutex_lock(&completion_chans_lock);
+    if (chan->mode != COMPLETION_MODE_STREAM || vma->vm_pgoff != 0 ||
+        vma->vm_end - vma->vm_start > PAGE_SIZE + PAGE_ALIGN(chan->size))
+        ret = -EINVAL;
+    else
+        ret = remap_vmalloc_range(vma, chan->hdr, 0);
+    if (!ret) {
+        vma->vm_ops = &completion_vm_ops;
+        vma->vm_private_data = chan;
+        chan->users++;
+    }
+    mutex_unlock(&completion_chans_lock);
+    return ret;
+}
+
+static int completion_open(struct inode *inode, struct file *filp)
+{
+    struct completion_file *cf;
+
+    cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+    if (!cf)
+        return -ENOMEM;
+    cf->chan = &comp;
+    mutex_init(&cf->join_lock);
+    mutex_init(&cf->cursor_lock);
+    cf->rcv_timeout = MAX_SCHEDULE_TIMEOUT;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&cf->timer, completion_coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&cf->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    cf->timer.function = completion_coalesce_timer;
+#endif
+    filp->private_data = cf;
+
+    mutex_lock(&completion_chans_lock);
+    completion_chan_enter(cf, &comp);
+    mutex_unlock(&completion_chans_lock);
+    return 0;
+}
+
+static int completion_release(struct inode *inode, struct file *filp)
+{
+    struct completion_file *cf = filp->private_data;
+
+    /* whatever we held back must not wait for a deadline that never comes */
+    hrtimer_cancel(&cf->timer);
+    completion_flush_wakeup(cf);
+
+    mutex_lock(&completion_chans_lock);
+    completion_chan_leave(cf);
+    mutex_unlock(&completion_chans_lock);
+    kfree(cf);
+    return 0;
 }
 
 static struct file_operations completion_fops = {
     .owner = THIS_MODULE,
-    .read  = completion_read,
-    .write = completion_write,
+    .open  = completion_open,
+    .release = completion_release,
+    .read_iter  = completion_read_iter,
+    .write_iter = completion_write_iter,
+    /* one copy between a pipe's pages and the ring, no user space bounce */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read  = copy_splice_read,
+#else
+    .splice_read  = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .unlocked_ioctl = completion_ioctl,
+    .poll  = completion_poll,
+    .mmap  = completion_mmap,
 };
 
 static struct miscdevice completion_miscdevice = {
@@ -64,23 +1539,28 @@ int complete_init(void)
 {
     int err = 0;
 
+    err = completion_chan_init(&comp, ring_size);
+    if (err) {
+        printk(KERN_ERR "no memory for a %u byte ring\n", ring_size);
+        return err;
+    }
+    list_add(&comp.list, &completion_chans);
+
     err = misc_register(&completion_miscdevice);
     if (err) {
         dev_err(completion_miscdevice.this_device, "misc_register() failed\n");
+        vfree(comp.hdr);
     }
     return err;
 }
 
 void complete_cleanup(void)
 {
-    int err;
-
-    err = misc_deregister(&completion_miscdevice);
-    if (err) {
-        dev_err(completion_miscdevice.this_device, "misc_deregister() failed\n");
-    }
+    /* misc_deregister() returns void since 4.3 */
+    misc_deregister(&completion_miscdevice);
+    vfree(comp.hdr);
 }
 
 module_init(complete_init);
 module_exit(complete_cleanup);
-MODULE_LICENSE("Dual BSD/GPL");
\ No newline at end of file
+MODULE_LICENSE("Dual BSD/GPL");
@@ -0,0 +1,196 @@
+#ifndef _COMPLETION_TEST_H
+#define _COMPLETION_TEST_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * ioctl interface of /dev/completion, shared with completion/app
+ */
+#define COMPLETION_IOC_MAGIC 'c'
+
+struct completion_coalesce {
+    __u32 bytes; /* wake readers once this many bytes are pending, 0: every write */
+    __u32 usecs; /* or this long after the first write that did not wake, 0: never */
+};
+
+struct completion_stats {
+    __u64 wakeups;       /* reader wakeups issued by writes */
+    __u64 wakeups_saved; /* writes that did not wake readers */
+    __u64 timer_wakeups; /* wakeups issued by a coalescing deadline */
+    __u64 overruns;      /* broadcast reads that found their data overwritten */
+    __u64 overrun_bytes; /* bytes those subscribers never saw */
+    __u64 spins;         /* reads that polled an empty ring before sleeping */
+    __u64 spin_hits;     /* of those, the ones that found data without sleeping */
+    __u64 spin_ns;       /* time spent polling */
+};
+
+/*
+ * A reader with spinning on polls an empty ring before it sleeps, for
+ * about twice the recent average gap between writes on the channel,
+ * but never longer than max_usecs; it does not poll at all when
+ * writes are further apart than that.
+ */
+struct completion_spin {
+    __u32 max_usecs;     /* 0: sleep right away */
+};
+
+/*
+ * Every open file starts out on channel 0 and can move to another
+ * channel, which has a ring, locks, mode and statistics of its own.
+ * A channel is named, or numbered when the name is empty; it is
+ * created when the first file joins it and freed when the last one
+ * leaves, except for channel 0. A file can only move before it has
+ * used its channel: after a read(), write(), poll(), mmap() or an
+ * ioctl other than the per-file settings, COMPLETION_IOC_JOIN fails
+ * with EBUSY.
+ */
+#define COMPLETION_CHANNEL_NAME_MAX 32
+
+struct completion_channel {
+    __u32 id;                               /* used when name is "" */
+    char name[COMPLETION_CHANNEL_NAME_MAX]; /* NUL terminated */
+};
+
+/*
+ * COMPLETION_MODE_STREAM: every byte is read once, by one reader;
+ *     writers wait for space.
+ * COMPLETION_MODE_BROADCAST: every open file has its own read cursor
+ *     and sees everything written after it was opened. Writers never
+ *     wait; a subscriber that falls more than a ring behind gets one
+ *     -EOVERFLOW from read() and continues at the newest data.
+ *
+ * COMPLETION_MODE_RECORD: every write() is one record, read() returns
+ *     one whole record or fails with -EMSGSIZE, leaving it queued, if
+ *     the buffer is too small. A record never exceeds the ring.
+ *
+ * COMPLETION_MODE_COUNTER: the ring is not used. write() adds a __u64
+ *     to a counter and read() returns it as a __u64 and resets it to
+ *     zero, sleeping while it is zero, like an eventfd. A write that
+ *     would take it past 2^64 - 2 fails with -EOVERFLOW.
+ * COMPLETION_MODE_SEMAPHORE: the same, but read() takes one at a time
+ *     and always returns 1.
+ *
+ * COMPLETION_MODE_PRIORITY: records, as in record mode, queued at the
+ *     priority of the file that wrote them (COMPLETION_IOC_SET_PRIO,
+ *     0 by default). read() returns the oldest record of the highest
+ *     priority queued, so urgent records overtake those already
+ *     waiting, like a POSIX message queue. Each level has its own
+ *     1/COMPLETION_PRIO_LEVELS of the ring, a record never exceeds it,
+ *     and a writer only ever waits for room at its own level.
+ *
+ * The mode can only be changed through the only open file of the
+ * channel while nobody maps the ring, and falls back to stream when
+ * the last file leaves. mmap() and COMPLETION_IOC_WAIT are for stream
+ * mode only.
+ */
+#define COMPLETION_MODE_STREAM    0
+#define COMPLETION_MODE_BROADCAST 1
+#define COMPLETION_MODE_RECORD    2
+#define COMPLETION_MODE_COUNTER   3
+#define COMPLETION_MODE_SEMAPHORE 4
+#define COMPLETION_MODE_PRIORITY  5
+
+#define COMPLETION_PRIO_LEVELS    8
+
+/*
+ * COMPLETION_IOC_RECV_BATCH dequeues up to max_msgs records that fit
+ * into buf_len bytes with one call, sleeping like read() while there
+ * are none. buf then holds them back to back, each as a __u32 length,
+ * the data, and padding up to a multiple of four
+ * (COMPLETION_RECORD_NEXT). Returns the number of records.
+ */
+struct completion_batch {
+    __u64 buf;
+    __u32 buf_len;
+    __u32 max_msgs;
+    __u32 msgs;          /* out */
+    __u32 bytes;         /* out: of buf used */
+};
+
+#define COMPLETION_RECORD_NEXT(len) (sizeof(__u32) + (((len) + 3) & ~3U))
+
+/*
+ * First page of the mmap()ed ring, the data follows at data_offset.
+ * head is advanced by producers and tail by consumers, modulo 2^32;
+ * data sits at index & (size - 1). head and the producer_waiting flag
+ * share the producer's cache line, tail and consumer_waiting the
+ * consumer's.
+ *
+ * A producer stores its data, publishes head (release), issues a full
+ * barrier and then rings COMPLETION_IOC_DOORBELL(COMPLETION_RING_DATA)
+ * only if consumer_waiting is set. A consumer can only be waiting on an
+ * empty ring, so the doorbell is only rung on an empty to non-empty
+ * transition and the steady state needs no system call. Consumers do
+ * the same with tail, producer_waiting and COMPLETION_RING_SPACE.
+ */
+struct completion_ring_hdr {
+    __u32 head;
+    __u32 producer_waiting;       /* producers asleep waiting for space */
+    __u8  pad0[64 - 2 * sizeof(__u32)];
+    __u32 tail;
+    __u32 consumer_waiting;       /* consumers asleep waiting for data */
+    __u8  pad1[64 - 2 * sizeof(__u32)];
+    __u32 size;                   /* data bytes, a power of two */
+    __u32 data_offset;            /* of the data in the mapping */
+};
+
+/* arguments of COMPLETION_IOC_DOORBELL and COMPLETION_IOC_WAIT */
+#define COMPLETION_RING_DATA  0
+#define COMPLETION_RING_SPACE 1
+
+/* per open file, applies to what this file writes */
+#define COMPLETION_IOC_SET_COALESCE _IOW(COMPLETION_IOC_MAGIC, 1, struct completion_coalesce)
+#define COMPLETION_IOC_GET_STATS    _IOR(COMPLETION_IOC_MAGIC, 2, struct completion_stats)
+/* wake whoever sleeps waiting for data or for space */
+#define COMPLETION_IOC_DOORBELL     _IO(COMPLETION_IOC_MAGIC, 3)
+/* sleep until the ring holds data, or has space */
+#define COMPLETION_IOC_WAIT         _IO(COMPLETION_IOC_MAGIC, 4)
+/* COMPLETION_MODE_*, see above */
+#define COMPLETION_IOC_SET_MODE     _IO(COMPLETION_IOC_MAGIC, 5)
+/* leave the current channel for another, see above */
+#define COMPLETION_IOC_JOIN         _IOW(COMPLETION_IOC_MAGIC, 6, struct completion_channel)
+/*
+ * a read() or COMPLETION_IOC_RECV_BATCH that has waited this long for
+ * data fails with -EAGAIN, like a socket's SO_RCVTIMEO
+ */
+struct completion_timeout {
+    __u32 msecs;         /* 0: wait forever */
+};
+
+/* per open file, applies to what this file reads */
+#define COMPLETION_IOC_SET_SPIN     _IOW(COMPLETION_IOC_MAGIC, 7, struct completion_spin)
+/* COMPLETION_MODE_RECORD only */
+#define COMPLETION_IOC_RECV_BATCH   _IOWR(COMPLETION_IOC_MAGIC, 8, struct completion_batch)
+/* per open file, applies to what this file reads */
+#define COMPLETION_IOC_SET_TIMEOUT  _IOW(COMPLETION_IOC_MAGIC, 9, struct completion_timeout)
+/* per open file, 0 to COMPLETION_PRIO_LEVELS - 1, applies to what this file writes */
+#define COMPLETION_IOC_SET_PRIO     _IO(COMPLETION_IOC_MAGIC, 10)
+
+#ifdef __KERNEL__
+/*
+ * for other drivers to feed a channel from the kernel, single producer,
+ * stream mode; see completion_test.c. write() fails while a driver is
+ * attached, but a process producing through a mmap()ed ring is not
+ * stopped and breaks the single producer rule, so a channel fed from
+ * the kernel must not be mapped writable.
+ *
+ *     chan = completion_chan_attach(&id);
+ *     ...
+ *     p = completion_chan_reserve(chan, len, &got);
+ *     if (p) {
+ *         fill in up to got bytes at p;
+ *         completion_chan_commit(chan, got);
+ *     }
+ *     ...
+ *     completion_chan_detach(chan);
+ */
+struct completion_chan;
+
+struct completion_chan *completion_chan_attach(const struct completion_channel *id);
+void completion_chan_detach(struct completion_chan *chan);
+void *completion_chan_reserve(struct completion_chan *chan, unsigned int len, unsigned int *got);
+void completion_chan_commit(struct completion_chan *chan, unsigned int len);
+#endif
+
+#endif /* _COMPLETION_TEST_H */
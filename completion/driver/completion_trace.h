@@ -0,0 +1,83 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM completion
+
+#if !defined(_COMPLETION_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _COMPLETION_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * /sys/kernel/tracing/events/completion/, all off by default.
+ * head and tail are the free running ring indices.
+ */
+
+DECLARE_EVENT_CLASS(completion_wait,
+    TP_PROTO(pid_t pid, unsigned int head, unsigned int tail),
+    TP_ARGS(pid, head, tail),
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+        __field(unsigned int, head)
+        __field(unsigned int, tail)
+    ),
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->head = head;
+        __entry->tail = tail;
+    ),
+    TP_printk("pid=%d head=%u tail=%u", __entry->pid, __entry->head, __entry->tail)
+);
+
+/* a reader finds nothing to read and goes to sleep */
+DEFINE_EVENT(completion_wait, completion_read_sleep,
+    TP_PROTO(pid_t pid, unsigned int head, unsigned int tail),
+    TP_ARGS(pid, head, tail)
+);
+
+/* and is awoken */
+DEFINE_EVENT(completion_wait, completion_read_wake,
+    TP_PROTO(pid_t pid, unsigned int head, unsigned int tail),
+    TP_ARGS(pid, head, tail)
+);
+
+/* a writer finds the ring full and goes to sleep */
+DEFINE_EVENT(completion_wait, completion_write_sleep,
+    TP_PROTO(pid_t pid, unsigned int head, unsigned int tail),
+    TP_ARGS(pid, head, tail)
+);
+
+DECLARE_EVENT_CLASS(completion_xfer,
+    TP_PROTO(pid_t pid, unsigned int index, size_t count),
+    TP_ARGS(pid, index, count),
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+        __field(unsigned int, index)
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->index = index;
+        __entry->count = count;
+    ),
+    TP_printk("pid=%d index=%u count=%zu", __entry->pid, __entry->index, __entry->count)
+);
+
+/* count bytes read starting at ring index */
+DEFINE_EVENT(completion_xfer, completion_read,
+    TP_PROTO(pid_t pid, unsigned int index, size_t count),
+    TP_ARGS(pid, index, count)
+);
+
+/* count bytes queued starting at ring index, the readers are about to be woken */
+DEFINE_EVENT(completion_xfer, completion_write,
+    TP_PROTO(pid_t pid, unsigned int index, size_t count),
+    TP_ARGS(pid, index, count)
+);
+
+#endif /* _COMPLETION_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE completion_trace
+#include <trace/define_trace.h>
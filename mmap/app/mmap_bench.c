@@ -0,0 +1,235 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/user.h> /* PAGE_SIZE */
+#include <linux/perf_event.h>
+#include <errno.h> /* errno */
+
+#include "../driver/mmap_test.h"
+
+/*
+ * Time from mmap() to the end of a first scan that touches every page
+ * of the mapping:
+ *
+ * lazy:     each page comes in through its own fault
+ * populate: lazy, but MAP_POPULATE takes all the faults in mmap()
+ * eager:    the driver maps the whole range with vm_insert_pages()
+ *
+ * The driver keeps its pages once allocated, so a warm-up run
+ * allocates them first and only the mapping cost is measured. Load the
+ * module with buffer_size=1073741824 for the 1 GB case.
+ *
+ * Then the bandwidth of sequential scans of a mapping that is already
+ * populated, with the dTLB load misses they take (perf_event_open(),
+ * "-" if we may not count them). Load the module with huge_pages=1
+ * and the lazy mapping gets 2 MB entries, the eager one keeps 4 KB
+ * entries, so one run compares both.
+ */
+
+#define DEVICE "/dev/mymmap"
+#define BUFFER_SIZE_PARAM "/sys/module/mmap_test/parameters/buffer_size"
+#define HUGE_PAGES_PARAM "/sys/module/mmap_test/parameters/huge_pages"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long buffer_size(void)
+{
+	unsigned long size = 0;
+	FILE *f;
+
+	f = fopen(BUFFER_SIZE_PARAM, "r");
+	if (f) {
+		if (fscanf(f, "%lu", &size) != 1)
+			size = 0;
+		fclose(f);
+	}
+	return size & ~(PAGE_SIZE - 1);
+}
+
+/* seconds from mmap() to the last page read, -1 on error */
+static double scan(int fd, unsigned long size, unsigned long map, int flags)
+{
+	volatile unsigned char *p;
+	unsigned long off;
+	double start, elapsed;
+
+	if (ioctl(fd, MYMMAP_IOC_SET_MAP, map)) {
+		perror("MYMMAP_IOC_SET_MAP");
+		return -1;
+	}
+
+	start = now();
+	p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | flags, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap() failed");
+		return -1;
+	}
+	for (off = 0; off < size; off += PAGE_SIZE)
+		(void)p[off];
+	elapsed = now() - start;
+
+	munmap((void *)p, size);
+	return elapsed;
+}
+
+/* a counter of this thread's dTLB load misses, -1 if we may not */
+static int tlb_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* GB/s of passes sequential reads of the whole mapping, -1 on error */
+static double bandwidth(int fd, unsigned long size, unsigned long map, int passes,
+			long long *misses)
+{
+	volatile unsigned long *p;
+	unsigned long i;
+	double start, elapsed;
+	int counter;
+	int pass;
+
+	if (ioctl(fd, MYMMAP_IOC_SET_MAP, map)) {
+		perror("MYMMAP_IOC_SET_MAP");
+		return -1;
+	}
+	p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap() failed");
+		return -1;
+	}
+	/* fault everything in first, we want the steady state */
+	for (i = 0; i < size / sizeof(*p); i += PAGE_SIZE / sizeof(*p))
+		(void)p[i];
+
+	counter = tlb_counter();
+	ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+	ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	start = now();
+	for (pass = 0; pass < passes; pass++) {
+		for (i = 0; i < size / sizeof(*p); i++)
+			(void)p[i];
+	}
+	elapsed = now() - start;
+	ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+	if (counter < 0 || read(counter, misses, sizeof(*misses)) != sizeof(*misses))
+		*misses = -1;
+	if (counter >= 0)
+		close(counter);
+
+	munmap((void *)p, size);
+	return (double)size * passes / elapsed / 1e9;
+}
+
+static int huge_pages(void)
+{
+	char c = 'N';
+	FILE *f;
+
+	f = fopen(HUGE_PAGES_PARAM, "r");
+	if (f) {
+		if (fscanf(f, " %c", &c) != 1)
+			c = 'N';
+		fclose(f);
+	}
+	return c == 'Y' || c == '1';
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		unsigned long map;
+		int flags;
+	} modes[] = {
+		{ "lazy", MYMMAP_MAP_LAZY, 0 },
+		{ "populate", MYMMAP_MAP_LAZY, MAP_POPULATE },
+		{ "eager", MYMMAP_MAP_EAGER, 0 },
+	};
+	unsigned long size = buffer_size();
+	int runs = 5;
+	long long misses;
+	double t, best;
+	int fd;
+	int i, j;
+
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 0) << 20;
+	if (argc > 2)
+		runs = atoi(argv[2]);
+	if (size == 0 || runs <= 0) {
+		fprintf(stderr, "Usage: mmap_bench [MB, default all of the buffer] [runs]\n");
+		return 1;
+	}
+
+	fd = open(DEVICE, O_RDWR);
+	if (fd < 0) {
+		perror("open() failed");
+		return errno;
+	}
+
+	/* allocate every page once, untimed */
+	if (scan(fd, size, MYMMAP_MAP_EAGER, 0) < 0) {
+		close(fd);
+		return 1;
+	}
+
+	printf("%lu MB, %lu pages, best of %d\n", size >> 20, size / PAGE_SIZE, runs);
+	printf("%-10s %10s %12s\n", "mode", "ms", "ns/page");
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		best = 1e9;
+		for (j = 0; j < runs; j++) {
+			t = scan(fd, size, modes[i].map, modes[i].flags);
+			if (t < 0) {
+				close(fd);
+				return 1;
+			}
+			if (t < best)
+				best = t;
+		}
+		printf("%-10s %10.2f %12.1f\n", modes[i].name, best * 1e3,
+		       best * 1e9 / (size / PAGE_SIZE));
+	}
+
+	printf("\nscans of a populated mapping, huge_pages=%d, %d passes\n", huge_pages(), runs);
+	printf("%-10s %10s %16s\n", "mode", "GB/s", "dTLB misses/MB");
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		if (modes[i].flags)
+			continue;
+		t = bandwidth(fd, size, modes[i].map, runs, &misses);
+		if (t < 0) {
+			close(fd);
+			return 1;
+		}
+		if (misses < 0)
+			printf("%-10s %10.2f %16s\n", modes[i].name, t, "-");
+		else
+			printf("%-10s %10.2f %16.1f\n", modes[i].name, t,
+			       (double)misses / runs / (size >> 20));
+	}
+
+	close(fd);
+	return 0;
+}
@@ -1,37 +1,444 @@
+#define _FILE_OFFSET_BITS 64 /* pool buffers live above 4 GB */
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <linux/dma-buf.h>
 #include <linux/fb.h>
 #include <sys/mman.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/user.h> /* PAGE_SIZE */
+#include <sys/wait.h>
 #include <errno.h> /* errno */
 
-int main(int argc, char **argv)
+#include "../driver/mmap_test.h"
+
+#define BUFFER_SIZE_PARAM "/sys/module/mmap_test/parameters/buffer_size"
+
+/* the size of the driver's buffer, whole pages */
+static unsigned long buffer_size(void)
+{
+	unsigned long size = 0;
+	FILE *f;
+
+	f = fopen(BUFFER_SIZE_PARAM, "r");
+	if (f) {
+		if (fscanf(f, "%lu", &size) != 1)
+			size = 0;
+		fclose(f);
+	}
+	return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+/*
+ * map the whole buffer, which costs nothing until pages are touched,
+ * and check that every mapping of an offset sees the same page
+ */
+static int buffer_test(int fd, unsigned long size)
 {
+	unsigned long last = size / PAGE_SIZE - 1;
+	unsigned char *p_mmap;
+	unsigned char *p_last;
+	int i;
+
+	p_mmap = (unsigned char *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p_mmap == MAP_FAILED) {
+		perror("mmap() failed\n");
+		return 1;
+	}
+
+	/* print ten bytes */
+	for (i = 0; i < 10; i++) {
+		printf("%d\n", p_mmap[i]);
+		if (p_mmap[i] != i) {
+			printf("buffer test: byte %d is %d\n", i, p_mmap[i]);
+			return 1;
+		}
+	}
+
+	p_mmap[size - 1] = 0x5a;
+	p_mmap[size / 2] = 0xa5;
+
+	/* just the last page, by offset */
+	p_last = (unsigned char *)mmap(0, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, last * PAGE_SIZE);
+	if (p_last == MAP_FAILED) {
+		perror("mmap() of the last page failed\n");
+		return 1;
+	}
+	if (p_last[PAGE_SIZE - 1] != 0x5a) {
+		printf("buffer test: last page differs between mappings\n");
+		return 1;
+	}
+	munmap(p_last, PAGE_SIZE);
+
+	/* one page too many */
+	if (mmap(0, 2 * PAGE_SIZE, PROT_READ, MAP_SHARED, fd, last * PAGE_SIZE) != MAP_FAILED ||
+	    errno != EINVAL) {
+		printf("buffer test: mapping past the end did not fail\n");
+		return 1;
+	}
+
+	munmap(p_mmap, size);
+	printf("buffer test: %lu bytes ok\n", size);
+	return 0;
+}
+
+#define POOL_SIZE (1024 * 1024)
+
+/*
+ * allocate two pool buffers, hand one to another process by id only,
+ * and free it while it is still mapped
+ */
+static int pool_test(int fd)
+{
+	struct mymmap_alloc a, b;
+	unsigned char *p;
+	pid_t pid;
+	int status;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.size = POOL_SIZE;
+	b.size = 3 * PAGE_SIZE;
+	if (ioctl(fd, MYMMAP_IOC_ALLOC, &a) || ioctl(fd, MYMMAP_IOC_ALLOC, &b)) {
+		perror("MYMMAP_IOC_ALLOC");
+		return 1;
+	}
+	if (a.id == b.id || a.offset != MYMMAP_POOL_OFFSET(a.id)) {
+		printf("pool test: ids %u and %u, offset %llx\n", a.id, b.id,
+		       (unsigned long long)a.offset);
+		return 1;
+	}
+
+	p = (unsigned char *)mmap(0, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, a.offset);
+	if (p == MAP_FAILED) {
+		perror("mmap() of a pool buffer failed\n");
+		return 1;
+	}
+	p[0] = 0x11;
+	p[POOL_SIZE - 1] = 0x22;
+
+	/* the child exits through exit(), which flushes what we buffered */
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		/* a consumer that knows nothing but the id */
+		int cfd = open("/dev/mymmap", O_RDWR);
+		unsigned char *q;
+
+		q = (unsigned char *)mmap(0, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+					  cfd, MYMMAP_POOL_OFFSET(a.id));
+		if (cfd < 0 || q == MAP_FAILED || q[0] != 0x11 || q[POOL_SIZE - 1] != 0x22)
+			exit(1);
+		q[1] = 0x33;
+		exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) || p[1] != 0x33) {
+		printf("pool test: the consumer saw something else\n");
+		return 1;
+	}
+
+	/* freed, but we still map it */
+	if (ioctl(fd, MYMMAP_IOC_FREE, a.id)) {
+		perror("MYMMAP_IOC_FREE");
+		return 1;
+	}
+	if (ioctl(fd, MYMMAP_IOC_FREE, a.id) >= 0 || errno != ENOENT) {
+		printf("pool test: freed twice\n");
+		return 1;
+	}
+	if (mmap(0, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, a.offset) != MAP_FAILED) {
+		printf("pool test: freed buffer can be mapped\n");
+		return 1;
+	}
+	p[2] = 0x44;
+	if (p[0] != 0x11 || p[2] != 0x44) {
+		printf("pool test: freed buffer changed under its mapping\n");
+		return 1;
+	}
+	munmap(p, POOL_SIZE);
+
+	if (mmap(0, 4 * PAGE_SIZE, PROT_READ, MAP_SHARED, fd, b.offset) != MAP_FAILED) {
+		printf("pool test: mapping past the end of a pool buffer did not fail\n");
+		return 1;
+	}
+	ioctl(fd, MYMMAP_IOC_FREE, b.id);
+
+	printf("pool test: ok\n");
+	return 0;
+}
+
+#define RING_BUFFER_SIZE (4 * PAGE_SIZE)
+#define RING_MESSAGES 1000000
+
+/* one side of a ring, see struct mymmap_ring */
+struct ring_side {
 	int fd;
+	struct mymmap_ring *r;
+	unsigned char *data;
+	unsigned int pos;	/* our own head or tail */
+	long doorbells;
+};
+
+static int ring_open(struct ring_side *rs, unsigned int id)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->fd = open("/dev/mymmap", O_RDWR);
+	if (rs->fd < 0 || ioctl(rs->fd, MYMMAP_IOC_SET_RING, id)) {
+		perror("MYMMAP_IOC_SET_RING");
+		return -1;
+	}
+	rs->r = mmap(0, RING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     rs->fd, MYMMAP_POOL_OFFSET(id));
+	if (rs->r == MAP_FAILED) {
+		perror("mmap() of the ring failed");
+		return -1;
+	}
+	rs->data = (unsigned char *)rs->r + rs->r->data_offset;
+	return 0;
+}
+
+/*
+ * sleep in poll() until the ring is readable or writable, unless it
+ * became so while we raised our flag
+ */
+static void ring_wait(struct ring_side *rs, unsigned int *flag, short event,
+		      unsigned int *other, unsigned int used_when_blocked)
+{
+	struct pollfd pfd = { rs->fd, event, 0 };
+
+	__atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((event == POLLIN ? __atomic_load_n(other, __ATOMIC_ACQUIRE) - rs->pos :
+	     rs->pos - __atomic_load_n(other, __ATOMIC_ACQUIRE)) == used_when_blocked)
+		poll(&pfd, 1, -1);
+	__atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+}
+
+/* publish pos as head or tail, ring the other side only if it sleeps */
+static void ring_publish(struct ring_side *rs, unsigned int *pos, unsigned int *waiting)
+{
+	__atomic_store_n(pos, rs->pos, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		ioctl(rs->fd, MYMMAP_IOC_DOORBELL);
+		rs->doorbells++;
+	}
+}
+
+static void ring_put(struct ring_side *rs, unsigned int v)
+{
+	struct mymmap_ring *r = rs->r;
+
+	while (rs->pos - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size)
+		ring_wait(rs, &r->producer_waiting, POLLOUT, &r->tail, r->size);
+	memcpy(rs->data + (rs->pos & (r->size - 1)), &v, sizeof(v));
+	rs->pos += sizeof(v);
+	ring_publish(rs, &r->head, &r->consumer_waiting);
+}
+
+static unsigned int ring_get(struct ring_side *rs)
+{
+	struct mymmap_ring *r = rs->r;
+	unsigned int v;
+
+	while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == rs->pos)
+		ring_wait(rs, &r->consumer_waiting, POLLIN, &r->head, 0);
+	memcpy(&v, rs->data + (rs->pos & (r->size - 1)), sizeof(v));
+	rs->pos += sizeof(v);
+	ring_publish(rs, &r->tail, &r->producer_waiting);
+	return v;
+}
+
+/*
+ * a producer process and a consumer process pass RING_MESSAGES numbers
+ * through a ring buffer, sleeping in poll() and ringing the doorbell
+ * only when the other side sleeps
+ */
+static int ring_test(int fd)
+{
+	struct mymmap_alloc a;
+	struct ring_side rs;
+	struct pollfd pfd;
+	pid_t pid;
+	int status;
+	unsigned int i;
+
+	memset(&a, 0, sizeof(a));
+	a.size = RING_BUFFER_SIZE;
+	a.flags = MYMMAP_ALLOC_RING;
+	if (ioctl(fd, MYMMAP_IOC_ALLOC, &a)) {
+		perror("MYMMAP_IOC_ALLOC");
+		return 1;
+	}
+	if (ring_open(&rs, a.id))
+		return 1;
+	if (ioctl(rs.fd, MYMMAP_IOC_SET_RING, a.id) >= 0 || errno != EBUSY) {
+		printf("ring test: file bound to a second ring\n");
+		return 1;
+	}
+
+	pfd.fd = rs.fd;
+	pfd.events = POLLIN | POLLOUT;
+	if (poll(&pfd, 1, 0) != 1 || pfd.revents != POLLOUT) {
+		printf("ring test: empty ring polls as %x\n", pfd.revents);
+		return 1;
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		struct ring_side prod;
+
+		if (ring_open(&prod, a.id))
+			exit(1);
+		for (i = 0; i < RING_MESSAGES; i++)
+			ring_put(&prod, i);
+		printf("ring test: producer rang %ld doorbells\n", prod.doorbells);
+		exit(0);
+	}
+
+	for (i = 0; i < RING_MESSAGES; i++) {
+		unsigned int v = ring_get(&rs);
+
+		if (v != i) {
+			printf("ring test: message %u is %u\n", i, v);
+			return 1;
+		}
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("ring test: producer failed\n");
+		return 1;
+	}
+	printf("ring test: consumer rang %ld doorbells\n", rs.doorbells);
+
+	munmap(rs.r, RING_BUFFER_SIZE);
+	close(rs.fd);
+	ioctl(fd, MYMMAP_IOC_FREE, a.id);
+	printf("ring test: %d messages ok\n", RING_MESSAGES);
+	return 0;
+}
+
+#define EXPORT_SIZE (64 * 1024)
+
+static int dmabuf_sync(int buf_fd, unsigned long long flags)
+{
+	struct dma_buf_sync sync = { flags };
+
+	if (ioctl(buf_fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+		perror("DMA_BUF_IOCTL_SYNC");
+		return -1;
+	}
+	return 0;
+}
+
+/* map the dma-buf and check or fill it with a pattern */
+static int dmabuf_access(int buf_fd, int write)
+{
+	unsigned char *p;
+	int err = 0;
 	int i;
-	unsigned char *p_mmap;
-	
+
+	p = (unsigned char *)mmap(0, EXPORT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, buf_fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap() of the dma-buf failed\n");
+		return 1;
+	}
+	if (dmabuf_sync(buf_fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW))
+		return 1;
+	for (i = 0; i < EXPORT_SIZE && !err; i++) {
+		if (write)
+			p[i] = i * 7;
+		else if (p[i] != (unsigned char)(i * 7))
+			err = 1;
+	}
+	if (dmabuf_sync(buf_fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW))
+		return 1;
+	munmap(p, EXPORT_SIZE);
+	return err;
+}
+
+/*
+ * export a buffer, fill it, and have another process see it through
+ * nothing but the inherited dma-buf fd; it outlives the device file
+ */
+static int dmabuf_test(int fd, unsigned long size)
+{
+	struct mymmap_export exp;
+	pid_t pid;
+	int status;
+
+	memset(&exp, 0, sizeof(exp));
+	exp.size = size + 1;
+	if (ioctl(fd, MYMMAP_IOC_EXPORT, &exp) >= 0 || errno != EINVAL) {
+		printf("dma-buf test: export larger than the buffer did not fail\n");
+		return 1;
+	}
+	exp.size = EXPORT_SIZE;
+	if (ioctl(fd, MYMMAP_IOC_EXPORT, &exp)) {
+		perror("MYMMAP_IOC_EXPORT");
+		return 1;
+	}
+	close(fd);
+
+	if (dmabuf_access(exp.fd, 1))
+		return 1;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+		exit(dmabuf_access(exp.fd, 0));
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("dma-buf test: the other process saw something else\n");
+		return 1;
+	}
+
+	close(exp.fd);
+	printf("dma-buf test: ok\n");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long size;
+	int fd;
+	int err;
+
 	/* open device */
 	fd = open("/dev/mymmap", O_RDWR);
 	if (fd < 0) {
 		perror("open() failed");
 		return errno;
-	} else {
-		/* map memory */
-		p_mmap = (unsigned char *)mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		if (p_mmap == MAP_FAILED) {
-			perror("mmap() failed\n");
-			return errno;
-		} else {
-			/* print ten bytes */
-			for (i = 0; i < PAGE_SIZE; i++) {
-				printf("%d\n", p_mmap[i]);
-			}
-			return 0;
-		}
 	}
-}	
+
+	size = buffer_size();
+	if (size == 0) {
+		perror("reading " BUFFER_SIZE_PARAM " failed");
+		return 1;
+	}
+
+	err = buffer_test(fd, size);
+	/* the same, with everything mapped by mmap() */
+	if (!err && ioctl(fd, MYMMAP_IOC_SET_MAP, MYMMAP_MAP_EAGER)) {
+		perror("MYMMAP_IOC_SET_MAP");
+		err = 1;
+	}
+	if (!err)
+		err = buffer_test(fd, size);
+	if (!err)
+		err = pool_test(fd);
+	if (!err)
+		err = ring_test(fd);
+	if (err) {
+		close(fd);
+		return err;
+	}
+	/* closes fd */
+	return dmabuf_test(fd, size);
+}
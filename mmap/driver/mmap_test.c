@@ -15,51 +15,846 @@
 #include <linux/list.h>
 #include <linux/pci.h>
 #include <linux/gpio.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/file.h>
+#include <linux/huge_mm.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/scatterlist.h>
+#include <linux/mutex.h>
+#include <linux/version.h>
+
+#include "mmap_test.h"
 
 #define DEVICE_NAME "mymmap"
 
+static unsigned long buffer_size = 4 * 1024 * 1024;
+module_param(buffer_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(buffer_size, "size of the shared buffer in bytes, rounded up to pages");
+
+static bool huge_pages;
+module_param(huge_pages, bool, S_IRUGO);
+MODULE_PARM_DESC(huge_pages, "back the buffer with 2 MB pages where possible");
+
 static unsigned char array[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
-static unsigned char *buffer;
+
+/*
+ * A buffer is an array of pages, allocated one by one when a mapping
+ * first touches them, so a large buffer maps at once and only costs the
+ * memory that is used. A page stays as long as its buffer, every
+ * mapping of the same offset sees the same page.
+ *
+ * With huge_pages, the first touch of a 2 MB aligned chunk allocates
+ * one 2 MB page for all of it, and pages[] points at its 512 subpages.
+ * Shared mappings map such chunks with one PMD entry (my_huge_fault()). If
+ * no 2 MB page is to be had, or the chunk sticks out of the buffer, it
+ * falls back to 4 KB pages for good.
+ *
+ * Buffer 0 is the device's own and lives as long as the module. The
+ * others make up the pool (MYMMAP_IOC_ALLOC); each mapping holds a
+ * reference, so a freed buffer goes away with its last mapping.
+ */
+#define CHUNK_ORDER (PMD_SHIFT - PAGE_SHIFT)
+#define CHUNK_PAGES (1UL << CHUNK_ORDER)
+
+struct my_buffer {
+	struct kref ref;
+	int id;				/* in pool, 0 for buffer */
+	struct page **pages;
+	unsigned long nr_pages;
+	struct mymmap_ring *ring;	/* MYMMAP_ALLOC_RING: page 0 */
+	u32 ring_size;			/* ring->size, which user space may scribble on */
+	wait_queue_head_t wait;		/* pollers of the ring */
+};
+
+static struct my_buffer buffer;
+static DEFINE_IDR(pool);
+static DEFINE_MUTEX(pool_lock);		/* pool */
+static DEFINE_MUTEX(chunk_lock);	/* huge_pages: who fills pages[] */
+
+/* the file offset in pages at which b is mapped */
+static unsigned long buffer_pgoff(struct my_buffer *b)
+{
+	return (unsigned long)b->id << (MYMMAP_POOL_SHIFT - PAGE_SHIFT);
+}
+
+static struct page *alloc_small(struct my_buffer *b, unsigned long index)
+{
+	struct page *page;
+
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	/* the first ten bytes, as ever */
+	if (page && b == &buffer && index == 0)
+		memcpy(page_address(page), array, sizeof(array));
+	return page;
+}
+
+/* a zeroed 2 MB compound page, without trying hard or warning */
+static struct page *alloc_chunk(void)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NORETRY | __GFP_NOWARN;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	struct folio *folio = folio_alloc(gfp, CHUNK_ORDER);
+
+	return folio ? &folio->page : NULL;
+#else
+	return alloc_pages(gfp | __GFP_COMP, CHUNK_ORDER);
+#endif
+}
+
+/*
+ * buffer_page_huge
+ * buffer_page() with huge_pages: a chunk nobody touched yet gets a 2 MB
+ * page if it can, index a 4 KB one otherwise
+ */
+static struct page *buffer_page_huge(struct my_buffer *b, unsigned long index)
+{
+	unsigned long first = round_down(index, CHUNK_PAGES);
+	struct page **pages = b->pages;
+	struct page *page;
+	unsigned long i;
+
+	mutex_lock(&chunk_lock);
+	page = pages[index];
+	if (page)
+		goto out;
+
+	if (first + CHUNK_PAGES <= b->nr_pages) {
+		for (i = first; i < first + CHUNK_PAGES && !pages[i]; i++)
+			;
+		page = i == first + CHUNK_PAGES ? alloc_chunk() : NULL;
+		if (page) {
+			if (b == &buffer && first == 0)
+				memcpy(page_address(page), array, sizeof(array));
+			for (i = 0; i < CHUNK_PAGES; i++)
+				WRITE_ONCE(pages[first + i], page + i);
+			page = pages[index];
+			goto out;
+		}
+	}
+
+	page = alloc_small(b, index);
+	if (page)
+		WRITE_ONCE(pages[index], page);
+out:
+	mutex_unlock(&chunk_lock);
+	return page;
+}
+
+/*
+ * buffer_page
+ * the page at index, allocated now if nobody touched it before.
+ * Lock-free: of two racing faults, the loser frees its page.
+ */
+static struct page *buffer_page(struct my_buffer *b, unsigned long index)
+{
+	struct page *page = READ_ONCE(b->pages[index]);
+	struct page *old;
+
+	if (page)
+		return page;
+	if (huge_pages)
+		return buffer_page_huge(b, index);
+
+	page = alloc_small(b, index);
+	if (!page)
+		return NULL;
+
+	old = cmpxchg(&b->pages[index], NULL, page);
+	if (old) {
+		__free_page(page);
+		return old;
+	}
+	return page;
+}
+
+static int buffer_init(struct my_buffer *b, unsigned long size)
+{
+	kref_init(&b->ref);
+	init_waitqueue_head(&b->wait);
+	b->nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	/* only the page pointers, the pages come with the faults */
+	b->pages = kvcalloc(b->nr_pages, sizeof(*b->pages), GFP_KERNEL);
+	return b->pages ? 0 : -ENOMEM;
+}
+
+static void buffer_free_pages(struct my_buffer *b)
+{
+	unsigned long i;
+
+	for (i = 0; i < b->nr_pages; i++) {
+		if (!b->pages[i])
+			continue;
+		if (!PageCompound(b->pages[i]))
+			__free_page(b->pages[i]);
+		else if (PageHead(b->pages[i]))
+			put_page(b->pages[i]);
+	}
+	kvfree(b->pages);
+	b->pages = NULL;
+}
+
+/* a pool buffer nobody maps and that is no longer in the pool */
+static void buffer_release(struct kref *ref)
+{
+	struct my_buffer *b = container_of(ref, struct my_buffer, ref);
+
+	buffer_free_pages(b);
+	kfree(b);
+}
+
+static void buffer_put(struct my_buffer *b)
+{
+	if (b != &buffer)
+		kref_put(&b->ref, buffer_release);
+}
+
+/* the buffer a mapping at pgoff is of, with a reference; NULL if none */
+static struct my_buffer *buffer_get(unsigned long pgoff)
+{
+	unsigned long id = pgoff >> (MYMMAP_POOL_SHIFT - PAGE_SHIFT);
+	struct my_buffer *b;
+
+	if (id == 0)
+		return &buffer;
+	if (id > MYMMAP_POOL_MAX)
+		return NULL;
+
+	mutex_lock(&pool_lock);
+	b = idr_find(&pool, id);
+	if (b)
+		kref_get(&b->ref);
+	mutex_unlock(&pool_lock);
+	return b;
+}
+
+static vm_fault_t my_fault(struct vm_fault *vmf)
+{
+	struct my_buffer *b = vmf->vma->vm_private_data;
+	unsigned long index = vmf->pgoff - buffer_pgoff(b);
+	struct page *page;
+
+	if (index >= b->nr_pages)
+		return VM_FAULT_SIGBUS;
+
+	page = buffer_page(b, index);
+	if (!page)
+		return VM_FAULT_OOM;
+
+	/* the core maps it and drops this reference when it is unmapped */
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}
+
+/*
+ * PMD mappings need THP, and huge_fault and the calls that insert a PMD
+ * changed shape a few times: since 6.14 the 2 MB page is inserted as a
+ * folio and refcounted like any page, before that by pfn into a
+ * VM_MIXEDMAP mapping.
+ */
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+#define MY_HUGE_FAULT
+#endif
+
+#ifdef MY_HUGE_FAULT
+static vm_fault_t my_huge_fault_pmd(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct my_buffer *b = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long first;
+	struct page *page;
+
+	/*
+	 * a private mapping needs copy on write, which only the 4 KB path
+	 * does: a PMD would hand it the shared chunk, writable
+	 */
+	if (!(vma->vm_flags & VM_SHARED))
+		return VM_FAULT_FALLBACK;
+
+	/* the PMD must lie within the mapping and on a chunk of the buffer */
+	if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	first = vma->vm_pgoff - buffer_pgoff(b) + ((addr - vma->vm_start) >> PAGE_SHIFT);
+	if (first % CHUNK_PAGES || first + CHUNK_PAGES > b->nr_pages)
+		return VM_FAULT_FALLBACK;
+
+	page = buffer_page(b, first);
+	if (!page)
+		return VM_FAULT_OOM;
+	if (!PageCompound(page))
+		return VM_FAULT_FALLBACK;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	return vmf_insert_folio_pmd(vmf, page_folio(page), vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(page_to_pfn(page)),
+				  vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t my_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	if (order != CHUNK_ORDER)
+		return VM_FAULT_FALLBACK;
+	return my_huge_fault_pmd(vmf);
+}
+#else
+static vm_fault_t my_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+	return my_huge_fault_pmd(vmf);
+}
+#endif
+#endif /* MY_HUGE_FAULT */
+
+/* a mapping copied by fork() or split by munmap() holds the buffer too */
+static void my_vm_open(struct vm_area_struct *vma)
+{
+	struct my_buffer *b = vma->vm_private_data;
+
+	if (b != &buffer)
+		kref_get(&b->ref);
+}
+
+static void my_vm_close(struct vm_area_struct *vma)
+{
+	buffer_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct my_vm_ops = {
+	.open = my_vm_open,
+	.close = my_vm_close,
+	.fault = my_fault,
+#ifdef MY_HUGE_FAULT
+	.huge_fault = my_huge_fault,
+#endif
+};
+
+/* per open file */
+struct my_file {
+	unsigned int map;		/* MYMMAP_MAP_* */
+	struct my_buffer *ring;		/* MYMMAP_IOC_SET_RING, with a reference, set once */
+};
 
 static int my_open(struct inode *indoe, struct file *filp)
 {
+	struct my_file *mf;
+
+	mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+	if (!mf)
+		return -ENOMEM;
+	mf->map = MYMMAP_MAP_LAZY;
+	filp->private_data = mf;
 	return 0;
 }
 
 static int my_release(struct inode *indoe, struct file *filp)
 {
+	struct my_file *mf = filp->private_data;
+
+	if (mf->ring)
+		buffer_put(mf->ring);
+	kfree(mf);
+	return 0;
+}
+
+/*
+ * my_poll
+ * readable while the ring of this file holds data, writable while it
+ * has room, going by the head and tail in the mapping. Sleepers are
+ * woken by MYMMAP_IOC_DOORBELL only.
+ */
+static __poll_t my_poll(struct file *filp, poll_table *wait)
+{
+	struct my_file *mf = filp->private_data;
+	struct my_buffer *b = READ_ONCE(mf->ring);
+	__poll_t mask = 0;
+	u32 used;
+
+	if (!b)
+		return EPOLLERR;
+
+	poll_wait(filp, &b->wait, wait);
+	/* a mapped header may hold anything, never trust it beyond the size */
+	used = READ_ONCE(b->ring->head) - READ_ONCE(b->ring->tail);
+	if (used)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (used < b->ring_size)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+/*
+ * Exported buffers, shared by dma-buf fd. Unlike the device's own
+ * buffer their pages are all allocated at once, since an importer may
+ * map them for DMA at any time, and they live until the last reference
+ * to the dma-buf is dropped, by fd, mapping or importing driver.
+ */
+struct my_dmabuf {
+	struct page **pages;
+	unsigned long nr_pages;
+	struct mutex lock;		/* attachments */
+	struct list_head attachments;
+};
+
+struct my_attachment {
+	struct list_head list;
+	struct device *dev;
+	struct sg_table *sgt;		/* while mapped, under lock */
+	enum dma_data_direction dir;
+};
+
+static void my_dmabuf_free(struct my_dmabuf *b)
+{
+	unsigned long i;
+
+	for (i = 0; i < b->nr_pages; i++) {
+		if (b->pages[i])
+			__free_page(b->pages[i]);
+	}
+	kvfree(b->pages);
+	kfree(b);
+}
+
+static int my_dmabuf_attach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+	struct my_dmabuf *b = dmabuf->priv;
+	struct my_attachment *a;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+	a->dev = attach->dev;
+	attach->priv = a;
+	mutex_lock(&b->lock);
+	list_add(&a->list, &b->attachments);
+	mutex_unlock(&b->lock);
+	return 0;
+}
+
+static void my_dmabuf_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+	struct my_dmabuf *b = dmabuf->priv;
+	struct my_attachment *a = attach->priv;
+
+	mutex_lock(&b->lock);
+	list_del(&a->list);
+	mutex_unlock(&b->lock);
+	kfree(a);
+}
+
+/* the pages as a scatterlist, mapped for the importing device */
+static struct sg_table *my_dmabuf_map(struct dma_buf_attachment *attach,
+				      enum dma_data_direction dir)
+{
+	struct my_dmabuf *b = attach->dmabuf->priv;
+	struct my_attachment *a = attach->priv;
+	struct sg_table *sgt;
+	int err;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+	err = sg_alloc_table_from_pages(sgt, b->pages, b->nr_pages, 0,
+					b->nr_pages << PAGE_SHIFT, GFP_KERNEL);
+	if (err)
+		goto free;
+	err = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (err)
+		goto free_table;
+
+	mutex_lock(&b->lock);
+	a->sgt = sgt;
+	a->dir = dir;
+	mutex_unlock(&b->lock);
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free:
+	kfree(sgt);
+	return ERR_PTR(err);
+}
+
+static void my_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+			    enum dma_data_direction dir)
+{
+	struct my_dmabuf *b = attach->dmabuf->priv;
+	struct my_attachment *a = attach->priv;
+
+	mutex_lock(&b->lock);
+	a->sgt = NULL;
+	mutex_unlock(&b->lock);
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+/*
+ * DMA_BUF_IOCTL_SYNC: hand the pages to the CPU, or back to the
+ * devices that have them mapped. Only does anything where DMA is not
+ * cache coherent, so on x86 both are free.
+ */
+static int my_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct my_dmabuf *b = dmabuf->priv;
+	struct my_attachment *a;
+
+	mutex_lock(&b->lock);
+	list_for_each_entry(a, &b->attachments, list) {
+		if (a->sgt)
+			dma_sync_sgtable_for_cpu(a->dev, a->sgt, a->dir);
+	}
+	mutex_unlock(&b->lock);
+	return 0;
+}
+
+static int my_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct my_dmabuf *b = dmabuf->priv;
+	struct my_attachment *a;
+
+	mutex_lock(&b->lock);
+	list_for_each_entry(a, &b->attachments, list) {
+		if (a->sgt)
+			dma_sync_sgtable_for_device(a->dev, a->sgt, a->dir);
+	}
+	mutex_unlock(&b->lock);
+	return 0;
+}
+
+/* vm_map_pages() checks the size and offset of the mapping for us */
+static int my_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct my_dmabuf *b = dmabuf->priv;
+
+	return vm_map_pages(vma, b->pages, b->nr_pages);
+}
+
+static void my_dmabuf_release(struct dma_buf *dmabuf)
+{
+	my_dmabuf_free(dmabuf->priv);
+}
+
+static const struct dma_buf_ops my_dmabuf_ops = {
+	.attach = my_dmabuf_attach,
+	.detach = my_dmabuf_detach,
+	.map_dma_buf = my_dmabuf_map,
+	.unmap_dma_buf = my_dmabuf_unmap,
+	.begin_cpu_access = my_dmabuf_begin_cpu_access,
+	.end_cpu_access = my_dmabuf_end_cpu_access,
+	.mmap = my_dmabuf_mmap,
+	.release = my_dmabuf_release,
+};
+
+/*
+ * my_export
+ * MYMMAP_IOC_EXPORT: a new zeroed buffer of size bytes, at most as big
+ * as the device's own, returned as a dma-buf fd
+ */
+static long my_export(struct mymmap_export __user *uexp)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct mymmap_export exp;
+	struct my_dmabuf *b;
+	struct dma_buf *dmabuf;
+	unsigned long i;
+	int fd;
+
+	if (copy_from_user(&exp, uexp, sizeof(exp)))
+		return -EFAULT;
+	if (exp.flags || exp.size == 0 || exp.size > buffer_size)
+		return -EINVAL;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	mutex_init(&b->lock);
+	INIT_LIST_HEAD(&b->attachments);
+	b->nr_pages = DIV_ROUND_UP(exp.size, PAGE_SIZE);
+	b->pages = kvcalloc(b->nr_pages, sizeof(*b->pages), GFP_KERNEL);
+	if (!b->pages) {
+		kfree(b);
+		return -ENOMEM;
+	}
+	for (i = 0; i < b->nr_pages; i++) {
+		b->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!b->pages[i]) {
+			my_dmabuf_free(b);
+			return -ENOMEM;
+		}
+	}
+
+	exp_info.ops = &my_dmabuf_ops;
+	exp_info.size = b->nr_pages << PAGE_SHIFT;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = b;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		my_dmabuf_free(b);
+		return PTR_ERR(dmabuf);
+	}
+
+	/* the fd goes live only once user space has its number */
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+	exp.fd = fd;
+	if (copy_to_user(uexp, &exp, sizeof(exp))) {
+		put_unused_fd(fd);
+		dma_buf_put(dmabuf);
+		return -EFAULT;
+	}
+	fd_install(fd, dmabuf->file);
 	return 0;
 }
 
+/*
+ * my_alloc
+ * MYMMAP_IOC_ALLOC: a new pool buffer of size bytes, at most as large
+ * as the device's own; its id and where to mmap() it go back
+ */
+static long my_alloc(struct mymmap_alloc __user *ualloc)
+{
+	struct mymmap_alloc alloc;
+	struct my_buffer *b;
+	int id;
+
+	if (copy_from_user(&alloc, ualloc, sizeof(alloc)))
+		return -EFAULT;
+	if ((alloc.flags & ~MYMMAP_ALLOC_RING) || alloc.size == 0 || alloc.size > buffer_size)
+		return -EINVAL;
+	/* a header page and at least one of data */
+	if ((alloc.flags & MYMMAP_ALLOC_RING) && alloc.size <= PAGE_SIZE)
+		return -EINVAL;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	if (buffer_init(b, alloc.size)) {
+		kfree(b);
+		return -ENOMEM;
+	}
+	if (alloc.flags & MYMMAP_ALLOC_RING) {
+		if (!buffer_page(b, 0)) {
+			buffer_release(&b->ref);
+			return -ENOMEM;
+		}
+		b->ring = page_address(b->pages[0]);
+		b->ring_size = rounddown_pow_of_two((b->nr_pages - 1) << PAGE_SHIFT);
+		b->ring->size = b->ring_size;
+		b->ring->data_offset = PAGE_SIZE;
+	}
+
+	mutex_lock(&pool_lock);
+	id = idr_alloc(&pool, b, 1, MYMMAP_POOL_MAX + 1, GFP_KERNEL);
+	if (id > 0)
+		b->id = id;
+	mutex_unlock(&pool_lock);
+	if (id < 0) {
+		buffer_release(&b->ref);
+		return id;
+	}
+
+	alloc.id = id;
+	alloc.offset = MYMMAP_POOL_OFFSET(id);
+	if (copy_to_user(ualloc, &alloc, sizeof(alloc))) {
+		/*
+		 * Ids are small and handed out in order, so another opener
+		 * may already have guessed this one, mapped it or freed it.
+		 * A mapping holds its own reference from buffer_get(); only
+		 * drop the pool's if it is still ours to drop.
+		 */
+		mutex_lock(&pool_lock);
+		if (idr_find(&pool, id) == b)
+			idr_remove(&pool, id);
+		else
+			b = NULL;
+		mutex_unlock(&pool_lock);
+		if (b)
+			buffer_put(b);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * my_set_ring
+ * MYMMAP_IOC_SET_RING: the ring buffer id is what this file polls and
+ * rings the doorbell of, for as long as it is open. Only once, so that
+ * poll() and the doorbell need no lock to look at it.
+ */
+static long my_set_ring(struct my_file *mf, unsigned long id)
+{
+	struct my_buffer *b;
+
+	if (id == 0 || id > MYMMAP_POOL_MAX)
+		return -EINVAL;
+	b = buffer_get(id << (MYMMAP_POOL_SHIFT - PAGE_SHIFT));
+	if (!b)
+		return -ENOENT;
+	if (!b->ring) {
+		buffer_put(b);
+		return -EINVAL;
+	}
+	if (cmpxchg(&mf->ring, NULL, b)) {
+		buffer_put(b);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/* MYMMAP_IOC_FREE: out of the pool, gone once the last mapping is */
+static long my_free(unsigned long id)
+{
+	struct my_buffer *b;
+
+	if (id == 0 || id > MYMMAP_POOL_MAX)
+		return -EINVAL;
+	mutex_lock(&pool_lock);
+	b = idr_remove(&pool, id);
+	mutex_unlock(&pool_lock);
+	if (!b)
+		return -ENOENT;
+	buffer_put(b);
+	return 0;
+}
+
+static long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct my_file *mf = filp->private_data;
+	struct my_buffer *b;
+
+	switch (cmd) {
+	case MYMMAP_IOC_SET_MAP:
+		if (arg != MYMMAP_MAP_LAZY && arg != MYMMAP_MAP_EAGER)
+			return -EINVAL;
+		mf->map = arg;
+		return 0;
+	case MYMMAP_IOC_EXPORT:
+		return my_export((struct mymmap_export __user *)arg);
+	case MYMMAP_IOC_ALLOC:
+		return my_alloc((struct mymmap_alloc __user *)arg);
+	case MYMMAP_IOC_FREE:
+		return my_free(arg);
+	case MYMMAP_IOC_SET_RING:
+		return my_set_ring(mf, arg);
+	case MYMMAP_IOC_DOORBELL:
+		b = READ_ONCE(mf->ring);
+		if (!b)
+			return -EINVAL;
+		wake_up_interruptible(&b->wait);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * my_map_eager
+ * allocate every page of the range and map them all now. vm_insert_pages()
+ * takes the page table lock once per table instead of once per page.
+ * It maps 4 KB entries only, even of 2 MB pages.
+ */
+static int my_map_eager(struct vm_area_struct *vma, struct my_buffer *b)
+{
+	unsigned long first = vma->vm_pgoff - buffer_pgoff(b);
+	unsigned long i, num = vma_pages(vma);
+	int err;
+
+	for (i = 0; i < num; i++) {
+		if (!buffer_page(b, first + i))
+			return -ENOMEM;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	/* num comes back as the number of pages it did not insert */
+	err = vm_insert_pages(vma, vma->vm_start, b->pages + first, &num);
+#else
+	for (err = 0, i = 0; i < num && !err; i++)
+		err = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, b->pages[first + i]);
+#endif
+	if (err)
+		printk(KERN_ERR "inserting pages failed: %d\n", err);
+	return err;
+}
+
+/*
+ * my_mmap
+ * the buffer the offset selects: 0 up for the device's own, from
+ * MYMMAP_POOL_OFFSET(id) for pool buffer id. Lazily, nothing is mapped
+ * here and my_fault() brings in pages as they are touched; eagerly,
+ * the whole range is mapped before we return.
+ */
 static int my_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	unsigned long page;
-	unsigned char i;
+	struct my_file *mf = filp->private_data;
+	unsigned long size = vma_pages(vma);
+	struct my_buffer *b;
+	unsigned long first;
 	int err;
-	unsigned long size = (unsigned long)(vma->vm_end - vma->vm_start);
 
-	/* get physicall address */
-	page = virt_to_phys(buffer);
+	b = buffer_get(vma->vm_pgoff);
+	if (!b)
+		return -EINVAL;
+	first = vma->vm_pgoff - buffer_pgoff(b);
+	if (first >= b->nr_pages || size > b->nr_pages - first) {
+		printk(KERN_ERR "mmap beyond the %lu byte buffer %d\n",
+		       b->nr_pages << PAGE_SHIFT, b->id);
+		buffer_put(b);
+		return -EINVAL;
+	}
 
-	/*  */
-	err = remap_pfn_range(vma, vma->vm_start, page >> PAGE_SHIFT, size, PAGE_SHARED);
-	if (err) {
-		printk(KERN_ERR "remap_pfn_range() failed\n");
-		return -1;
-	} else {
-		/* write ten bytes in buffer */
-		for (i = 0; i < 10; i++) {
-			buffer[i] = array[i];
+	/* mremap() must not grow it past the buffer */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_DONTEXPAND);
+#else
+	vma->vm_flags |= VM_DONTEXPAND;
+#endif
+#ifdef MY_HUGE_FAULT
+	/* let the fault path try PMDs even if THP is only on for madvise() */
+	if (huge_pages) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+		vm_flags_set(vma, VM_HUGEPAGE);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+		vm_flags_set(vma, VM_HUGEPAGE | VM_MIXEDMAP);
+#else
+		vma->vm_flags |= VM_HUGEPAGE | VM_MIXEDMAP;
+#endif
+	}
+#endif
+	if (mf->map == MYMMAP_MAP_EAGER) {
+		err = my_map_eager(vma, b);
+		if (err) {
+			buffer_put(b);
+			return err;
 		}
-		return err;
 	}
-}	
+	/* from here on the mapping holds our reference, my_vm_close() drops it */
+	vma->vm_private_data = b;
+	vma->vm_ops = &my_vm_ops;
+	return 0;
+}
 
 static struct file_operations dev_fops = {
 	.owner = THIS_MODULE,
 	.open = my_open,
 	.release = my_release,
 	.mmap = my_mmap,
+	.unlocked_ioctl = my_ioctl,
+	.poll = my_poll,
+	/* PMD aligned addresses for mappings of 2 MB and more */
+	.get_unmapped_area = thp_get_unmapped_area,
 };
 
 static struct miscdevice misc = {
@@ -72,47 +867,51 @@ static int __init dev_init(void)
 {
 	int err;
 
+	/* pool buffers are mapped from MYMMAP_POOL_OFFSET(1) up */
+	if (buffer_size == 0 || buffer_size > MYMMAP_POOL_OFFSET(1)) {
+		printk(KERN_ERR "buffer_size must be from 1 to %llu\n", MYMMAP_POOL_OFFSET(1));
+		return -EINVAL;
+	}
+
+	err = buffer_init(&buffer, buffer_size);
+	if (err) {
+		printk(KERN_ERR "kvcalloc() failed\n");
+		return err;
+	}
+
 	/* registe misc device */
 	err = misc_register(&misc);
 	if (err) {
 		printk(KERN_ERR "misc_register() failed\n");
-		return -1;
-	} else {
-		/* alloc memory to buffer */
-		buffer = (unsigned char *)kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!buffer) {
-			printk(KERN_ERR "kmalloc() failed\n");
-			return -1;
-		} else {
-			/* set the malloced memory as reserved */
-			SetPageReserved(virt_to_page(buffer));
-			return err;
-		}
+		buffer_free_pages(&buffer);
+		return err;
 	}
+	return 0;
 }
 
 static void __exit dev_exit(void)
 {
-	int err;
+	struct my_buffer *b;
+	int id;
 
-	/* deregister misc device */
-	err = misc_deregister(&misc);
-	if (err) {
-		printk(KERN_ERR "misc_deregister() failed\n");
-	} else {
-		/* clear reserved memory that we have alloced */
-		ClearPageReserved(virt_to_page(buffer));
-
-		/* free malloced memory */
-		if (buffer != NULL) {
-		    kfree(buffer);
-		}
-		buffer = NULL;
-	}
+	/*
+	 * deregister misc device. Open files and mappings hold the module,
+	 * so nothing can fault any more; the mappings' own page references
+	 * are gone too. What is left in the pool was never freed.
+	 */
+	misc_deregister(&misc);
+	idr_for_each_entry(&pool, b, id)
+		buffer_put(b);
+	idr_destroy(&pool);
+	buffer_free_pages(&buffer);
 }
 
 module_init(dev_init);
 module_exit(dev_exit);
 MODULE_LICENSE("GPL");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
 MODULE_AUTHOR("LKN@SCUT jiankangshiye@aliyun.com");
-
@@ -0,0 +1,98 @@
+#ifndef _MMAP_TEST_H
+#define _MMAP_TEST_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * ioctl interface of /dev/mymmap, shared with mmap/app
+ */
+#define MYMMAP_IOC_MAGIC 'm'
+
+/*
+ * MYMMAP_MAP_LAZY: mmap() maps nothing, every page is brought in by
+ *     the fault on its first touch. Cheap for sparse use.
+ * MYMMAP_MAP_EAGER: mmap() allocates the whole range and maps it with
+ *     batched page table updates, so a full scan takes no faults.
+ */
+#define MYMMAP_MAP_LAZY  0
+#define MYMMAP_MAP_EAGER 1
+
+/*
+ * MYMMAP_IOC_EXPORT allocates a buffer of its own, of size bytes and at
+ * most as large as the device's, and returns it as a dma-buf fd: it can
+ * be mmap()ed, passed to other processes and imported by other
+ * drivers, and is freed when the last of them lets go of it. Bracket
+ * CPU access with DMA_BUF_IOCTL_SYNC (linux/dma-buf.h) on that fd.
+ */
+struct mymmap_export {
+	__u64 size;	/* in, rounded up to pages */
+	__u32 flags;	/* in, must be 0 */
+	__s32 fd;	/* out */
+};
+
+/*
+ * A pool of buffers besides the device's own, each allocated with
+ * MYMMAP_IOC_ALLOC and mapped, by any process that knows its id, at
+ * offset MYMMAP_POOL_OFFSET(id). MYMMAP_IOC_FREE(id) takes it out of
+ * the pool; it goes away once nobody maps it any more. The device's
+ * own buffer is at offset 0 and at most MYMMAP_POOL_OFFSET(1) big.
+ */
+#define MYMMAP_POOL_SHIFT 32
+#define MYMMAP_POOL_OFFSET(id) ((__u64)(id) << MYMMAP_POOL_SHIFT)
+#define MYMMAP_POOL_MAX 1024
+
+struct mymmap_alloc {
+	__u64 size;	/* in, rounded up to pages, at most the device's */
+	__u32 flags;	/* in, MYMMAP_ALLOC_* */
+	__u32 id;	/* out, 1 to MYMMAP_POOL_MAX */
+	__u64 offset;	/* out, MYMMAP_POOL_OFFSET(id) */
+};
+
+/*
+ * MYMMAP_ALLOC_RING: the buffer is a byte ring for one producer and one
+ * consumer that share it by mmap(). Page 0 is a struct mymmap_ring the
+ * driver fills in, the data starts at data_offset. head and tail run
+ * freely and are masked with size - 1 on use; head is only written by
+ * the producer, tail only by the consumer.
+ *
+ * Nobody needs a system call while the ring is neither empty nor full.
+ * A consumer that finds it empty sets consumer_waiting, issues a full
+ * barrier, looks at head once more and only then sleeps in poll() on a
+ * file bound to the ring with MYMMAP_IOC_SET_RING, clearing the flag
+ * when it wakes. A producer stores its data, publishes head (release),
+ * issues a full barrier and rings MYMMAP_IOC_DOORBELL only if
+ * consumer_waiting is set, which it can only be when the ring was
+ * empty: one doorbell per empty to non-empty transition. Producers
+ * waiting for room work the same way round with producer_waiting and
+ * POLLOUT.
+ */
+#define MYMMAP_ALLOC_RING 1
+
+struct mymmap_ring {
+	__u32 size;		/* of the data, a power of two */
+	__u32 data_offset;	/* of the data in the buffer */
+	__u32 pad0[14];
+	/* the producer's cache line */
+	__u32 head;
+	__u32 consumer_waiting;
+	__u32 pad1[14];
+	/* the consumer's */
+	__u32 tail;
+	__u32 producer_waiting;
+	__u32 pad2[14];
+};
+
+/* per open file, applies to the mmap() calls that follow */
+#define MYMMAP_IOC_SET_MAP _IO(MYMMAP_IOC_MAGIC, 1)
+/* a new dma-buf, see above */
+#define MYMMAP_IOC_EXPORT  _IOWR(MYMMAP_IOC_MAGIC, 2, struct mymmap_export)
+/* pool buffers, see above; MYMMAP_IOC_FREE takes the id */
+#define MYMMAP_IOC_ALLOC   _IOWR(MYMMAP_IOC_MAGIC, 3, struct mymmap_alloc)
+#define MYMMAP_IOC_FREE    _IO(MYMMAP_IOC_MAGIC, 4)
+/* per open file, once: the id of the ring poll() and the doorbell are for */
+#define MYMMAP_IOC_SET_RING _IO(MYMMAP_IOC_MAGIC, 5)
+/* wake whoever sleeps in poll() on the ring */
+#define MYMMAP_IOC_DOORBELL _IO(MYMMAP_IOC_MAGIC, 6)
+
+#endif
@@ -0,0 +1,131 @@
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t on 32-bit targets too */
+
+#include <stdio.h> /* printf */
+#include <stdlib.h> /* strtoll */
+#include <string.h> /* memset */
+#include <fcntl.h> /* O_RDWR */
+#include <unistd.h> /* pread/pwrite */
+#include <errno.h> /* errno */
+#include <time.h> /* clock_gettime */
+
+#define DEVICE "/dev/scull0"
+#define GB (1024LL * 1024 * 1024)
+
+static const char *device = DEVICE;
+static long long span = 4096 * GB; /* 4 TB of sparse address space */
+static long long ops = 100000;
+static size_t block = 1000;        /* one default quantum */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * xorshift, so every run touches the same offsets
+ */
+static unsigned long long next_offset(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return (x % (span / block)) * block;
+}
+
+static void report(const char *name, double seconds)
+{
+	printf("%-12s %10lld ops %8.3f s %12.0f ops/s %10.2f MB/s\n", name, ops, seconds,
+	       ops / seconds, ops * (double)block / seconds / (1024 * 1024));
+}
+
+static int run(int fd, const char *name, int do_write, int random)
+{
+	unsigned long long state = 88172645463325252ULL;
+	char buf[block];
+	off_t off = 8 * GB; /* sequential passes start above 4 GB */
+	double start;
+	ssize_t n;
+	long long i;
+
+	memset(buf, 0x5a, sizeof(buf));
+	start = now();
+	for (i = 0; i < ops; i++) {
+		if (random) {
+			off = next_offset(&state);
+		}
+		if (do_write) {
+			n = pwrite(fd, buf, block, off);
+		} else {
+			n = pread(fd, buf, block, off);
+		}
+		if (n < 0) {
+			fprintf(stderr, "%s at %lld failed: %s\n", name, (long long)off, strerror(errno));
+			return -1;
+		}
+		if (!random) {
+			off += block;
+		}
+	}
+	report(name, now() - start);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd;
+
+	if (argc > 1) {
+		device = argv[1];
+	}
+	if (argc > 2) {
+		span = strtoll(argv[2], NULL, 0) * GB;
+	}
+	if (argc > 3) {
+		ops = strtoll(argv[3], NULL, 0);
+	}
+	if (argc > 4) {
+		block = strtoul(argv[4], NULL, 0);
+	}
+	if (span < (long long)block || ops <= 0 || block == 0) {
+		fprintf(stderr, "Usage: scull3_bench [device] [span GB] [ops] [block bytes]\n");
+		return 1;
+	}
+
+	/* opening write-only trims the device */
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		perror("open " DEVICE " failed");
+		return errno;
+	}
+	close(fd);
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open " DEVICE " failed");
+		return errno;
+	}
+
+	printf("%s: span %lld GB, block %zu bytes\n", device, span / GB, block);
+	if (run(fd, "seq-write", 1, 0) || run(fd, "seq-read", 0, 0) ||
+	    run(fd, "rand-write", 1, 1) || run(fd, "rand-read", 0, 1)) {
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	/* trim again, a sparse run leaves a lot of quanta behind */
+	fd = open(device, O_WRONLY);
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return 0;
+}
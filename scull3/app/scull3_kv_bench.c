@@ -0,0 +1,281 @@
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t on 32-bit targets too */
+
+#include <stdio.h> /* printf */
+#include <stdlib.h> /* strtol */
+#include <string.h> /* memset */
+#include <fcntl.h> /* O_RDWR */
+#include <unistd.h> /* pread/pwrite */
+#include <errno.h> /* errno */
+#include <time.h> /* clock_gettime */
+#include <pthread.h> /* pthread_create */
+#include <sys/ioctl.h> /* ioctl */
+
+#include "../driver/scull3.h"
+
+/*
+ * SCULL_IOCKV* against the old way: a user-space hash map from key to
+ * offset, with the values read and written through pread/pwrite
+ */
+
+#define DEVICE "/dev/scull0"
+#define KEY_LEN 16
+#define MAX_THREADS 64
+
+static const char *device = DEVICE;
+static int nr_keys = 10000;
+static int value_size = 256;
+static long ops = 200000; /* GETs per measurement, spread over the threads */
+static int max_threads = 4;
+
+/* the user-space index: open addressing, key number -> slot */
+static int *slot_of;
+static int slots;
+
+struct worker {
+	pthread_t tid;
+	int fd;
+	long ops;
+	int use_kv;
+	unsigned int seed;
+	int failed;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_key(char *key, int i)
+{
+	snprintf(key, KEY_LEN, "key-%011d", i);
+}
+
+static unsigned int hash_key(const char *key)
+{
+	unsigned int h = 2166136261U; /* FNV-1a */
+	int i;
+
+	for (i = 0; i < KEY_LEN; i++) {
+		h = (h ^ (unsigned char)key[i]) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * the user-space map is keyed by the same strings, so lookups pay for
+ * hashing and probing like the kernel does
+ */
+static int map_lookup(const char *key, int insert_as)
+{
+	unsigned int i = hash_key(key) & (slots - 1);
+	char other[KEY_LEN];
+
+	while (slot_of[i] >= 0) {
+		make_key(other, slot_of[i]);
+		if (!memcmp(other, key, KEY_LEN)) {
+			return i;
+		}
+		i = (i + 1) & (slots - 1);
+	}
+	if (insert_as >= 0) {
+		slot_of[i] = insert_as;
+		return i;
+	}
+	return -1;
+}
+
+static int kv_put(int fd, int i, char *value)
+{
+	struct scull_kv_io io;
+	char key[KEY_LEN];
+
+	make_key(key, i);
+	io.key = (unsigned long)key;
+	io.key_len = KEY_LEN;
+	io.value = (unsigned long)value;
+	io.value_len = value_size;
+
+	return ioctl(fd, SCULL_IOCKVPUT, &io);
+}
+
+static int kv_get(int fd, int i, char *value)
+{
+	struct scull_kv_io io;
+	char key[KEY_LEN];
+
+	make_key(key, i);
+	io.key = (unsigned long)key;
+	io.key_len = KEY_LEN;
+	io.value = (unsigned long)value;
+	io.value_len = value_size;
+
+	return ioctl(fd, SCULL_IOCKVGET, &io);
+}
+
+static int rw_put(int fd, int i, char *value)
+{
+	char key[KEY_LEN];
+	off_t off;
+	size_t done;
+	ssize_t n;
+
+	make_key(key, i);
+	off = (off_t)map_lookup(key, i) * value_size;
+	for (done = 0; done < value_size; done += n) {
+		n = pwrite(fd, value + done, value_size - done, off + done);
+		if (n <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int rw_get(int fd, int i, char *value)
+{
+	char key[KEY_LEN];
+	off_t off;
+	size_t done;
+	ssize_t n;
+	int slot;
+
+	make_key(key, i);
+	slot = map_lookup(key, -1);
+	if (slot < 0) {
+		return -1;
+	}
+	off = (off_t)slot * value_size;
+	for (done = 0; done < value_size; done += n) {
+		n = pread(fd, value + done, value_size - done, off + done);
+		if (n <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *get_worker(void *arg)
+{
+	struct worker *w = arg;
+	char value[value_size];
+	long i;
+	int err;
+
+	for (i = 0; i < w->ops; i++) {
+		int k = rand_r(&w->seed) % nr_keys;
+
+		err = w->use_kv ? kv_get(w->fd, k, value) : rw_get(w->fd, k, value);
+		if (err) {
+			w->failed++;
+		}
+	}
+	return NULL;
+}
+
+static int run(const char *name, int use_kv)
+{
+	struct worker workers[MAX_THREADS];
+	char value[value_size];
+	double start;
+	int threads;
+	int fd;
+	int i;
+
+	/* opening write-only trims the byte stream */
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		perror("open " DEVICE " failed");
+		return -1;
+	}
+	close(fd);
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open " DEVICE " failed");
+		return -1;
+	}
+
+	memset(value, 0x5a, sizeof(value));
+	memset(slot_of, 0xff, slots * sizeof(*slot_of));
+	start = now();
+	for (i = 0; i < nr_keys; i++) {
+		if ((use_kv ? kv_put(fd, i, value) : rw_put(fd, i, value))) {
+			fprintf(stderr, "%s put %d failed: %s\n", name, i, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	printf("%-4s put        %10.0f ops/s\n", name, nr_keys / (now() - start));
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		int failed = 0;
+
+		start = now();
+		for (i = 0; i < threads; i++) {
+			workers[i].fd = fd;
+			workers[i].ops = ops / threads;
+			workers[i].use_kv = use_kv;
+			workers[i].seed = i + 1;
+			workers[i].failed = 0;
+			pthread_create(&workers[i].tid, NULL, get_worker, &workers[i]);
+		}
+		for (i = 0; i < threads; i++) {
+			pthread_join(workers[i].tid, NULL);
+			failed += workers[i].failed;
+		}
+		printf("%-4s get x%-3d  %10.0f ops/s %s\n", name, threads,
+		       (ops / threads) * threads / (now() - start), failed ? "(failures!)" : "");
+	}
+
+	if (use_kv) {
+		for (i = 0; i < nr_keys; i++) {
+			struct scull_kv_io io;
+			char key[KEY_LEN];
+
+			make_key(key, i);
+			io.key = (unsigned long)key;
+			io.key_len = KEY_LEN;
+			ioctl(fd, SCULL_IOCKVDEL, &io);
+		}
+	}
+	close(fd);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1) {
+		device = argv[1];
+	}
+	if (argc > 2) {
+		nr_keys = strtol(argv[2], NULL, 0);
+	}
+	if (argc > 3) {
+		value_size = strtol(argv[3], NULL, 0);
+	}
+	if (argc > 4) {
+		max_threads = strtol(argv[4], NULL, 0);
+	}
+	if (nr_keys <= 0 || value_size <= 0 || value_size > 64 * 1024 ||
+	    max_threads <= 0 || max_threads > MAX_THREADS) {
+		fprintf(stderr, "Usage: scull3_kv_bench [device] [keys] [value bytes] [max threads]\n");
+		return 1;
+	}
+
+	for (slots = 1; slots < nr_keys * 2; slots *= 2)
+		;
+	slot_of = malloc(slots * sizeof(*slot_of));
+	if (!slot_of) {
+		perror("malloc");
+		return 1;
+	}
+
+	printf("%s: %d keys, %d byte values\n", device, nr_keys, value_size);
+	if (run("kv", 1) || run("rw", 0)) {
+		return 1;
+	}
+
+	return 0;
+}
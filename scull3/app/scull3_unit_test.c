@@ -0,0 +1,362 @@
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t on 32-bit targets too */
+
+#include <stdio.h> /* printf */
+#include <stdlib.h> /* exit */
+#include <string.h> /* memcmp */
+#include <fcntl.h> /* O_RDWR */
+#include <unistd.h> /* pread/pwrite */
+#include <errno.h> /* errno */
+#include <sys/ioctl.h> /* ioctl */
+
+#include "../driver/scull3.h"
+
+#define _toString(x) #x
+#define toString(x) _toString(x)
+#define LOG_ERR(...) do{ fprintf(stderr, "file: " __FILE__ " line:" toString(__LINE__) " "__VA_ARGS__); }while(0)
+
+#define DEVICE "/dev/scull0"
+#define GB (1024LL * 1024 * 1024)
+#define TB (1024LL * GB)
+
+static const char *device = DEVICE;
+
+static int scull_reset(void);
+static int pwrite_full(int fd, const char *buf, size_t count, off_t off);
+static int pread_full(int fd, char *buf, size_t count, off_t off);
+static int offset_test(off_t off, int do_write);
+static int hole_test(void);
+static int size_test(off_t expect);
+static int eof_test(off_t size);
+static int layout_test(const off_t *offsets, int n);
+static int digest_test(off_t off, size_t len);
+
+int main(int argc, char *argv[])
+{
+	static const off_t offsets[] = {
+		0,
+		2 * GB - 5,      /* straddles the old signed 32-bit limit */
+		4 * GB + 7,      /* beyond 32-bit unsigned */
+		1 * TB + 3,      /* very sparse */
+		3 * TB - 11,
+	};
+	int failed = 0;
+	int i;
+
+	if (argc > 1)
+		device = argv[1];
+
+	if (scull_reset()) {
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+		if (offset_test(offsets[i], 1)) {
+			failed++;
+		}
+	}
+	failed += hole_test() != 0;
+	failed += size_test(3 * TB - 11 + 32) != 0;
+	failed += eof_test(3 * TB - 11 + 32) != 0;
+	failed += layout_test(offsets, sizeof(offsets) / sizeof(offsets[0])) != 0;
+	failed += digest_test(0, 64 * 1024) != 0;
+	failed += digest_test(2 * GB - 4096, 8192) != 0;
+
+	printf("%s: %d failed\n", device, failed);
+	scull_reset(); /* give the memory back */
+
+	return failed ? 1 : 0;
+}
+
+/*
+ * opening write-only trims the device to 0
+ */
+static int scull_reset(void)
+{
+	int fd;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		LOG_ERR("open(%s) failed:%s\n", device, strerror(errno));
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * scull reads and writes at most one quantum per call, so loop
+ */
+static int pwrite_full(int fd, const char *buf, size_t count, off_t off)
+{
+	ssize_t n;
+
+	while (count) {
+		n = pwrite(fd, buf, count, off);
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		off += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+static int pread_full(int fd, char *buf, size_t count, off_t off)
+{
+	ssize_t n;
+
+	while (count) {
+		n = pread(fd, buf, count, off);
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		off += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * write a pattern at off (unless it is already there) and read it back
+ */
+static int offset_test(off_t off, int do_write)
+{
+	char wbuf[32];
+	char rbuf[32];
+	int err = -1;
+	int fd;
+
+	snprintf(wbuf, sizeof(wbuf), "scull3 at %016llx", (long long)off);
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		LOG_ERR("open(%s) failed:%s\n", device, strerror(errno));
+		return -1;
+	}
+
+	do {
+		if (do_write && pwrite_full(fd, wbuf, sizeof(wbuf), off)) {
+			LOG_ERR("pwrite at %lld failed:%s\n", (long long)off, strerror(errno));
+			break;
+		}
+		if (pread_full(fd, rbuf, sizeof(rbuf), off)) {
+			LOG_ERR("pread at %lld failed:%s\n", (long long)off, strerror(errno));
+			break;
+		}
+		if (memcmp(wbuf, rbuf, sizeof(wbuf))) {
+			LOG_ERR("data mismatch at %lld\n", (long long)off);
+			break;
+		}
+		err = 0;
+	} while (0);
+
+	close(fd);
+
+	return err;
+}
+
+/*
+ * the never written gap between two writes must read back as zeroes
+ */
+static int hole_test(void)
+{
+	char rbuf[4096];
+	int err = 0;
+	int fd;
+	int i;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERR("open(%s) failed:%s\n", device, strerror(errno));
+		return -1;
+	}
+
+	if (pread_full(fd, rbuf, sizeof(rbuf), 1 * GB)) {
+		LOG_ERR("pread in hole failed:%s\n", strerror(errno));
+		err = -1;
+	} else {
+		for (i = 0; i < sizeof(rbuf); i++) {
+			if (rbuf[i]) {
+				LOG_ERR("hole byte %d is %d\n", i, rbuf[i]);
+				err = -1;
+				break;
+			}
+		}
+	}
+
+	close(fd);
+
+	return err;
+}
+
+/*
+ * SEEK_END must see the 64-bit device size
+ */
+static int size_test(off_t expect)
+{
+	off_t size;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERR("open(%s) failed:%s\n", device, strerror(errno));
+		return -1;
+	}
+	size = lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	if (size != expect) {
+		LOG_ERR("size is %lld, expect %lld\n", (long long)size, (long long)expect);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * reading at or past the end returns 0
+ */
+static int eof_test(off_t size)
+{
+	char rbuf[16];
+	ssize_t n;
+	int fd;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERR("open(%s) failed:%s\n", device, strerror(errno));
+		return -1;
+	}
+	n = pread(fd, rbuf, sizeof(rbuf), size);
+	close(fd);
+
+	if (n != 0) {
+		LOG_ERR("pread at end returned %zd\n", n);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * repack into another layout and check nothing moved
+ */
+static int layout_test(const off_t *offsets, int n)
+{
+	struct scull_layout layout = { 4096, 64 };
+	int err = -1;
+	int fd;
+	int i;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERR("open(%s) failed:%s\n", device, strerror(errno));
+		return -1;
+	}
+
+	do {
+		if (ioctl(fd, SCULL_IOCSLAYOUT, &layout)) {
+			LOG_ERR("SCULL_IOCSLAYOUT failed:%s\n", strerror(errno));
+			break;
+		}
+		if (ioctl(fd, SCULL_IOCSYNC)) {
+			LOG_ERR("SCULL_IOCSYNC failed:%s\n", strerror(errno));
+			break;
+		}
+		memset(&layout, 0, sizeof(layout));
+		if (ioctl(fd, SCULL_IOCGLAYOUT, &layout)) {
+			LOG_ERR("SCULL_IOCGLAYOUT failed:%s\n", strerror(errno));
+			break;
+		}
+		if (layout.quantum != 4096 || layout.qset != 64) {
+			LOG_ERR("layout is %d/%d after repack\n", layout.quantum, layout.qset);
+			break;
+		}
+		err = 0;
+	} while (0);
+	close(fd);
+
+	/* the data written by offset_test() must still be there */
+	for (i = 0; !err && i < n; i++) {
+		err = offset_test(offsets[i], 0);
+	}
+	if (!err) {
+		err = hole_test();
+	}
+
+	return err;
+}
+
+/*
+ * plain bitwise CRC32C (Castagnoli), reflected polynomial 0x82f63b78
+ */
+static unsigned int crc32c(unsigned int crc, const unsigned char *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+	}
+
+	return crc;
+}
+
+/*
+ * SCULL_IOCDIGEST must match a CRC32C of the same bytes read back
+ */
+static int digest_test(off_t off, size_t len)
+{
+	struct scull_digest dg;
+	unsigned char *buf;
+	unsigned int crc;
+	int err = -1;
+	int fd;
+
+	buf = malloc(len);
+	if (!buf) {
+		LOG_ERR("malloc(%zu) failed\n", len);
+		return -1;
+	}
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERR("open(%s) failed:%s\n", device, strerror(errno));
+		free(buf);
+		return -1;
+	}
+
+	do {
+		if (pread_full(fd, (char *)buf, len, off)) {
+			LOG_ERR("pread at %lld failed:%s\n", (long long)off, strerror(errno));
+			break;
+		}
+		crc = ~crc32c(~0U, buf, len);
+
+		memset(&dg, 0, sizeof(dg));
+		dg.offset = off;
+		dg.length = len;
+		dg.algo = SCULL_DIGEST_CRC32C;
+		if (ioctl(fd, SCULL_IOCDIGEST, &dg)) {
+			LOG_ERR("SCULL_IOCDIGEST failed:%s\n", strerror(errno));
+			break;
+		}
+		if (dg.digest != crc) {
+			LOG_ERR("digest at %lld is %08llx, expect %08x\n", (long long)off, dg.digest, crc);
+			break;
+		}
+		err = 0;
+	} while (0);
+
+	close(fd);
+	free(buf);
+
+	return err;
+}
@@ -1,52 +1,168 @@
 #include <linux/cdev.h>
+#include <linux/crc32c.h>
+#include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/random.h>
+#include <linux/rbtree.h>
+#include <linux/rculist.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
 #include <linux/semaphore.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <asm/uaccess.h>
 
+#include "scull3.h"
+
+#define SCULL_QUANTUM_MIN  16
+#define SCULL_QUANTUM_MAX  (128 * 1024)
+#define SCULL_QSET_MIN     16
+#define SCULL_QSET_MAX     ((int)(SCULL_QUANTUM_MAX / sizeof(void *)))
+#define SCULL_AUTO_PERIOD  64 /* writes between two layout decisions */
+#define SCULL_DIGEST_BATCH (1024 * 1024) /* bytes hashed per dev->sem hold */
+#define SCULL_KV_MIN_BITS  4
+#define SCULL_KV_MAX_BITS  16
+#define SCULL_KV_RUN_MAX   (PAGE_SIZE / sizeof(void *)) /* quanta per object */
+
 struct scull_qset {
 	void **data;
-	struct scull_qset *next;
+	struct rb_node node; /* in scull_dev->data */
+	loff_t index; /* covers [index * quantum * qset, (index + 1) * quantum * qset) */
+};
+
+/*
+ * an object of the key-value store: a run of quanta plus its key.
+ * The table holds one reference, every GET in flight another one.
+ */
+struct scull_obj {
+	struct hlist_node hnode;
+	struct rcu_head rcu;
+	atomic_t refcount;
+	u32 hash;
+	unsigned int size;     /* value bytes */
+	int quantum;           /* bytes per quantum of this object */
+	int nr;                /* quanta, the last one may be short */
+	void **data;
+	unsigned int key_len;
+	char key[0];
+};
+
+struct scull_kv_table {
+	unsigned int bits;
+	u32 seed;  /* of the hash, kept across resizes */
+	struct hlist_head buckets[0];
+};
+
+/*
+ * GETs look objects up under rcu_read_lock() without taking any lock,
+ * PUT/DELETE/resize serialise on sem. A resize moves objects between
+ * tables under seq, a GET that missed while it ran simply retries.
+ */
+struct scull_kv {
+	struct scull_kv_table *table; /* NULL until the first PUT */
+	struct semaphore sem;
+	seqcount_t seq;
+	unsigned int count;
 };
 
 struct scull_dev {
-	struct scull_qset *data;
+	struct rb_root data;     /* scull_qsets by index, holes are simply missing */
+	struct scull_qset *hint; /* last scull_qset found, I/O within it skips the tree */
 	int quantum; /* sizeof(this->data->data[0])/sizeof(this->data->data[0][0]) */
 	int qset;    /* sizeof(this->data->data)/sizeof(this->data->data[0]) */
-	unsigned long size;      /* used size */
+	loff_t size;             /* used size */
 	unsigned int access_key; /* sculluid, scullpriv */
 	struct semaphore sem;    /* mutext lock */
 	struct cdev cdev;        /* char device struct */
+
+	/* online repacking into a new quantum/qset layout */
+	struct scull_dev *shadow; /* the new layout being filled, NULL if idle */
+	loff_t compact_pos;       /* everything below is already in shadow */
+	unsigned int compact_gen; /* bumped whenever a repack starts or is aborted */
+	struct work_struct compact_work;
+	wait_queue_head_t compact_wait;
+
+	/* SCULL_IOCAUTO */
+	int auto_layout;
+	unsigned int avg_write;   /* moving average of write sizes */
+	unsigned int nr_writes;
+
+	struct scull_kv kv;       /* SCULL_IOCKV*, independent of data */
+};
+
+/* values of scull_private */
+#define SCULL_SHARED   0 /* every opener shares the one device */
+#define SCULL_PER_UID  1 /* sculluid: one private device per uid */
+#define SCULL_PER_TGID 2 /* scullpriv: one private device per process */
+
+#define SCULL_HASH_BITS 6
+
+/*
+ * a lazily created private device, looked up by access_key on open
+ * and reclaimed by scull_reap() once it has been idle long enough
+ */
+struct scull_listitem {
+	struct scull_dev device;
+	int users;               /* open files, protected by scull_hash_sem */
+	unsigned long last_used; /* jiffies of the last release */
+	struct hlist_node hnode;
 };
 
 static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos); 
 static ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static loff_t scull_llseek(struct file *filp, loff_t off, int whence);
 static int scull_release(struct inode *inode, struct file *filp);
 static int scull_open(struct inode *inode, struct file *filp);
 static int scull_trim(struct scull_dev *dev);
-static struct scull_qset *scull_follow(struct scull_dev *dev, int item);
+static void scull_free_qsets(struct rb_root *root, int qset);
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static struct scull_qset *scull_follow(struct scull_dev *dev, loff_t item, int create);
+static void scull_reap(struct work_struct *work);
+static void scull_compact(struct work_struct *work);
+static void scull_compact_abort(struct scull_dev *dev);
+static void scull_auto_layout(struct scull_dev *dev, size_t count);
+static void scull_kv_destroy(struct scull_kv *kv);
 
 static int scull_major = 0;
 static int scull_minor = 0;
 static int scull_quantum = 1000;
 static int scull_qset    = 1000;
 static int scull_nr_devs = 4;
+static int scull_private = SCULL_SHARED;
+static int scull_idle_timeout = 60; /* seconds */
 static struct scull_dev dev;
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset,  int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
+module_param(scull_private, int, S_IRUGO);
+module_param(scull_idle_timeout, int, S_IRUGO);
+
+/* private devices, hashed by access_key */
+static struct hlist_head scull_hash[1 << SCULL_HASH_BITS];
+static DECLARE_MUTEX(scull_hash_sem);
+static DECLARE_DELAYED_WORK(scull_reap_work, scull_reap);
 
 
 static struct file_operations scull_fops = {
 	.owner  = THIS_MODULE,
+	.llseek = scull_llseek,
 	.read   = scull_read,
 	.write  = scull_write,
+	.unlocked_ioctl = scull_ioctl,
 	.open   = scull_open,
 	.release= scull_release,
 };
@@ -70,63 +186,254 @@ static void scull_setup_cdev(struct scull_dev *dev, int index)
 		printk(KERN_NOTICE "Error %d adding scull%d", err, index);
 }
 
+static void scull_dev_init(struct scull_dev *dev)
+{
+	dev->quantum = scull_quantum;
+	dev->qset    = scull_qset;
+	init_MUTEX(&dev->sem);
+	INIT_WORK(&dev->compact_work, scull_compact);
+	init_waitqueue_head(&dev->compact_wait);
+	init_MUTEX(&dev->kv.sem);
+	seqcount_init(&dev->kv.seq);
+}
+
+/*
+ * scull_dev_destroy
+ * free everything a device holds, nobody may have it open
+ */
+static void scull_dev_destroy(struct scull_dev *dev)
+{
+	cancel_work_sync(&dev->compact_work);
+	scull_trim(dev);
+	scull_kv_destroy(&dev->kv);
+}
+
+/*
+ * scull_private_get
+ * find the private device of the calling uid or process, creating it
+ * on first use. Tenants never share a scull_dev, so they never share
+ * its semaphore or its memory either.
+ */
+static struct scull_dev *scull_private_get(void)
+{
+	struct scull_listitem *lptr;
+	struct hlist_node *pos;
+	struct hlist_head *head;
+	unsigned int key;
+
+	if (scull_private == SCULL_PER_UID)
+		key = current_uid();
+	else
+		key = current->tgid;
+	head = &scull_hash[hash_long(key, SCULL_HASH_BITS)];
+
+	if (down_interruptible(&scull_hash_sem))
+		return ERR_PTR(-ERESTARTSYS);
+
+	hlist_for_each_entry(lptr, pos, head, hnode) {
+		if (lptr->device.access_key == key)
+			goto found;
+	}
+
+	lptr = kzalloc(sizeof(*lptr), GFP_KERNEL);
+	if (!lptr) {
+		up(&scull_hash_sem);
+		return ERR_PTR(-ENOMEM);
+	}
+	lptr->device.access_key = key;
+	scull_dev_init(&lptr->device);
+	hlist_add_head(&lptr->hnode, head);
+
+found:
+	lptr->users++;
+	up(&scull_hash_sem);
+
+	return &lptr->device;
+}
+
+static void scull_private_put(struct scull_dev *dev)
+{
+	struct scull_listitem *lptr;
+
+	lptr = container_of(dev, struct scull_listitem, device);
+	down(&scull_hash_sem);
+	lptr->users--;
+	lptr->last_used = jiffies;
+	up(&scull_hash_sem);
+}
+
+/*
+ * scull_reap
+ * free private devices nobody has had open for scull_idle_timeout seconds
+ */
+static void scull_reap(struct work_struct *work)
+{
+	struct scull_listitem *lptr;
+	struct hlist_node *pos, *n;
+	unsigned long timeout = scull_idle_timeout * HZ;
+	int i;
+
+	down(&scull_hash_sem);
+	for (i = 0; i < ARRAY_SIZE(scull_hash); i++) {
+		hlist_for_each_entry_safe(lptr, pos, n, &scull_hash[i], hnode) {
+			if (lptr->users)
+				continue;
+			if (time_before(jiffies, lptr->last_used + timeout))
+				continue;
+			hlist_del(&lptr->hnode);
+			scull_dev_destroy(&lptr->device);
+			kfree(lptr);
+		}
+	}
+	up(&scull_hash_sem);
+
+	schedule_delayed_work(&scull_reap_work, timeout);
+}
+
 static int scull_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev;
 
-	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+	if (scull_private != SCULL_SHARED) {
+		dev = scull_private_get();
+		if (IS_ERR(dev))
+			return PTR_ERR(dev);
+	} else {
+		dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+	}
 	filp->private_data = dev; /* private data, here just store a scull_dev pointer */
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		if (down_interruptible(&dev->sem)) {
+			if (scull_private != SCULL_SHARED)
+				scull_private_put(dev);
+			return -ERESTARTSYS;
+		}
 		scull_trim(dev);
+		up(&dev->sem);
 	}
 
 	return 0; /* success */
 }
 
-static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) 
+/*
+ * scull_split
+ * turn a byte offset into (which scull_qset, which data[], offset in it).
+ * Everything is 64-bit, quantum * qset may itself be larger than 4 GB.
+ */
+static void scull_split(struct scull_dev *dev, loff_t pos, loff_t *item, int *s_pos, int *q_pos)
+{
+	u64 itemsize = (u64)dev->quantum * dev->qset;
+	u64 rest;
+	u32 rem;
+
+	*item = div64_u64(pos, itemsize);
+	rest  = pos - *item * itemsize;
+	*s_pos = div_u64_rem(rest, dev->quantum, &rem);
+	*q_pos = rem;
+}
+
+/*
+ * scull_locate
+ * return the kernel address of byte pos and, in *avail, how many bytes
+ * follow it in the same quantum. NULL means a hole, or out of memory
+ * when create is set.
+ */
+static char *scull_locate(struct scull_dev *dev, loff_t pos, int create, size_t *avail)
 {
-	struct scull_dev *dev;
 	struct scull_qset *dptr;
-	int quantum;
-	int qset;
-	int itemsize;
-	int item;
+	loff_t item;
 	int s_pos;
 	int q_pos;
-	int rest;
+
+	scull_split(dev, pos, &item, &s_pos, &q_pos);
+	*avail = dev->quantum - q_pos;
+
+	/* walk to the item'th scull_qset */
+	dptr = scull_follow(dev, item, create);
+	if (dptr == NULL)
+		return NULL;
+	/* no scull_qset->data yet */
+	if (!dptr->data) {
+		if (!create)
+			return NULL;
+		dptr->data = kzalloc(dev->qset * sizeof(char *), GFP_KERNEL);
+		if (!dptr->data)
+			return NULL;
+	}
+	/* no scull_qset->data[s_pos], zeroed so partial quanta read back clean */
+	if (!dptr->data[s_pos]) {
+		if (!create)
+			return NULL;
+		dptr->data[s_pos] = kzalloc(dev->quantum, GFP_KERNEL);
+		if (!dptr->data[s_pos])
+			return NULL;
+	}
+
+	return (char *)dptr->data[s_pos] + q_pos;
+}
+
+/*
+ * scull_store
+ * copy a kernel buffer into the device, allocating as needed
+ */
+static int scull_store(struct scull_dev *dev, loff_t pos, const char *src, size_t count)
+{
+	size_t avail;
+	char *dst;
+
+	while (count) {
+		dst = scull_locate(dev, pos, 1, &avail);
+		if (!dst)
+			return -ENOMEM;
+		if (avail > count)
+			avail = count;
+		memcpy(dst, src, avail);
+		src   += avail;
+		pos   += avail;
+		count -= avail;
+	}
+	if (dev->size < pos)
+		dev->size = pos;
+
+	return 0;
+}
+
+static ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) 
+{
+	struct scull_dev *dev;
+	size_t avail;
+	char *src;
 	ssize_t retval = 0;
 
 	dev = filp->private_data;
-	quantum = dev->quantum;
-	qset = dev->qset;
-	itemsize = quantum * qset;
+
+	if (*f_pos < 0)
+		return -EINVAL;
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
 	if (*f_pos >= dev->size)
 		goto out;
-	if (*f_pos + count > dev->size)
+	if (count > dev->size - *f_pos)
 		count = dev->size - *f_pos;
 
 	/* which scull_qset, which scull_qset->data[] */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; /* offset of scull_qset->data */
-	q_pos = rest % quantum; /* offset of scull_qset->data[s_pos] */
-
-	/* get the "which scull_qset" */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
-		goto out;
+	src = scull_locate(dev, *f_pos, 0, &avail);
 
-	/* read data from scull_dev */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos; /* why not read next quantum */
+	/* read one quantum at most */
+	if (count > avail)
+		count = avail;
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+	if (!src) {
+		/* a hole of a sparse device reads back as zeroes */
+		if (clear_user(buf, count)) {
+			retval = -EFAULT;
+			goto out;
+		}
+	} else if (copy_to_user(buf, src, count)) {
 		retval = -EFAULT;
 		goto out;
 	}
@@ -142,60 +449,47 @@ out:
 static ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
 	struct scull_dev *dev;
-	struct scull_qset *dptr;
-	int quantum;
-	int qset;
-	int itemsize;
-	int item;
-	int s_pos;
-	int q_pos;
-	int rest;
-	int retval;
+	size_t requested = count;
+	size_t avail;
+	char *dst;
+	ssize_t retval;
 
 	dev = filp->private_data;
-	quantum = dev->quantum;
-	qset = dev->qset;
-	itemsize = quantum * qset;
-	retval = -EINVAL;
-	
+
+	if (*f_pos < 0)
+		return -EINVAL;
+	if (*f_pos >= MAX_LFS_FILESIZE)
+		return -EFBIG;
+	if (count > MAX_LFS_FILESIZE - *f_pos)
+		count = MAX_LFS_FILESIZE - *f_pos;
+
 	/* lock start */
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
 
-	/* which linked scull_qset, which scull_qset->data */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos= rest / quantum; /* offset of scull_qset->data */
-	q_pos= rest % quantum; /* offset of scull_qset->data[s_pos] */
-
-	/* walk to the item'th scull_qset */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
+	/* which linked scull_qset, which scull_qset->data, created if a hole */
+	dst = scull_locate(dev, *f_pos, 1, &avail);
+	if (!dst) {
+		retval = -ENOMEM;
 		goto out;
-	/* no scull_qset->data for writting */
-	if (!dptr->data) {
-		dptr->data = (void **)kmalloc(qset * sizeof(char *), GFP_KERNEL); /* (void **) is needed ? */
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-
-	/* no scull_qset->data[s_pos] */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
 	}
 
 	/* write one quantum at most */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	if (count > avail)
+		count = avail;
 
 	/* real writting */
-	if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
+	if (copy_from_user(dst, buf, count)) {
 		retval = -EFAULT;
 		goto out;
 	}
+
+	/* a repack has already copied this range, keep the new layout in sync */
+	if (dev->shadow && *f_pos < dev->compact_pos) {
+		if (scull_store(dev->shadow, *f_pos, dst, count))
+			scull_compact_abort(dev);
+	}
+
 	*f_pos += count;
 	retval =  count;
 
@@ -203,51 +497,766 @@ static ssize_t scull_write(struct file *filp, const char __user *buf, size_t cou
 	if (dev->size < *f_pos)
 		dev->size = *f_pos;
 
+	if (dev->auto_layout)
+		scull_auto_layout(dev, requested);
+
 out:
 	up(&dev->sem);
 	return retval;
 }
 
+/*
+ * scull_llseek
+ * the generic one knows nothing about dev->size, so SEEK_END needs us
+ */
+static loff_t scull_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct scull_dev *dev = filp->private_data;
+	loff_t newpos;
+
+	switch (whence) {
+	case SEEK_SET:
+		newpos = off;
+		break;
+	case SEEK_CUR:
+		newpos = filp->f_pos + off;
+		break;
+	case SEEK_END:
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		newpos = dev->size + off;
+		up(&dev->sem);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (newpos < 0 || newpos > MAX_LFS_FILESIZE)
+		return -EINVAL;
+	filp->f_pos = newpos;
+
+	return newpos;
+}
+
+/*
+ * scull_compact_start
+ * begin repacking into a new layout. Called with dev->sem held.
+ */
+static int scull_compact_start(struct scull_dev *dev, int quantum, int qset)
+{
+	struct scull_dev *shadow;
+
+	if (dev->shadow)
+		return -EBUSY;
+	if (quantum == dev->quantum && qset == dev->qset)
+		return 0;
+
+	/* nothing stored, nothing to repack */
+	if (RB_EMPTY_ROOT(&dev->data)) {
+		dev->quantum = quantum;
+		dev->qset    = qset;
+		return 0;
+	}
+
+	shadow = kzalloc(sizeof(*shadow), GFP_KERNEL);
+	if (!shadow)
+		return -ENOMEM;
+	shadow->quantum = quantum;
+	shadow->qset    = qset;
+
+	dev->shadow = shadow;
+	dev->compact_pos = 0;
+	dev->compact_gen++;
+	schedule_work(&dev->compact_work);
+
+	return 0;
+}
+
+/*
+ * scull_compact_abort
+ * throw the half built layout away. Called with dev->sem held.
+ */
+static void scull_compact_abort(struct scull_dev *dev)
+{
+	struct scull_dev *shadow = dev->shadow;
+
+	dev->shadow = NULL;
+	dev->compact_gen++;
+	scull_free_qsets(&shadow->data, shadow->qset);
+	kfree(shadow);
+	wake_up_interruptible_all(&dev->compact_wait);
+}
+
+/* items in index order, for walking the whole device */
+static struct scull_qset *scull_qset_first(struct scull_dev *dev)
+{
+	struct rb_node *node = rb_first(&dev->data);
+
+	return node ? rb_entry(node, struct scull_qset, node) : NULL;
+}
+
+static struct scull_qset *scull_qset_next(struct scull_qset *dptr)
+{
+	struct rb_node *node = rb_next(&dptr->node);
+
+	return node ? rb_entry(node, struct scull_qset, node) : NULL;
+}
+
+/*
+ * scull_compact
+ * copy the device into dev->shadow one scull_qset at a time. dev->sem is
+ * dropped between items, so readers and writers wait for one item at
+ * most, never for the whole repack. scull_write() mirrors writes that
+ * land below compact_pos into the shadow.
+ */
+static void scull_compact(struct work_struct *work)
+{
+	struct scull_dev *dev = container_of(work, struct scull_dev, compact_work);
+	struct scull_dev *shadow;
+	struct scull_qset *dptr, *prev = NULL;
+	struct rb_root old;
+	unsigned int gen;
+	loff_t itemsize;
+	loff_t pos;
+	int old_qset;
+	int i;
+
+	down(&dev->sem);
+	shadow = dev->shadow;
+	gen = dev->compact_gen;
+	if (!shadow) {
+		up(&dev->sem);
+		return;
+	}
+	itemsize = (loff_t)dev->quantum * dev->qset;
+
+	/* nodes are only unlinked by scull_trim(), which bumps compact_gen */
+	for (dptr = scull_qset_first(dev); dptr; dptr = scull_qset_next(prev)) {
+		for (i = 0; dptr->data && i < dev->qset; i++) {
+			pos = dptr->index * itemsize + (loff_t)i * dev->quantum;
+			if (pos >= dev->size)
+				break;
+			if (!dptr->data[i])
+				continue;
+			if (scull_store(shadow, pos, dptr->data[i],
+					min_t(loff_t, dev->quantum, dev->size - pos))) {
+				scull_compact_abort(dev);
+				up(&dev->sem);
+				return;
+			}
+		}
+		dev->compact_pos = (dptr->index + 1) * itemsize;
+		prev = dptr;
+
+		up(&dev->sem);
+		cond_resched();
+		down(&dev->sem);
+		if (dev->compact_gen != gen) {
+			/* trimmed or aborted meanwhile, shadow is gone */
+			up(&dev->sem);
+			return;
+		}
+	}
+
+	/* everything is copied, switch to the new layout */
+	old      = dev->data;
+	old_qset = dev->qset;
+	dev->data    = shadow->data;
+	dev->quantum = shadow->quantum;
+	dev->qset    = shadow->qset;
+	dev->hint    = NULL;
+	dev->shadow  = NULL;
+	dev->compact_gen++;
+	up(&dev->sem);
+
+	kfree(shadow);
+	scull_free_qsets(&old, old_qset);
+	wake_up_interruptible_all(&dev->compact_wait);
+}
+
+static int scull_off_by_4(int cur, unsigned long want)
+{
+	return cur >= want * 4 || want >= (unsigned long)cur * 4;
+}
+
+/*
+ * scull_auto_layout
+ * size quanta after the typical write and the qset after the device size,
+ * and repack once the layout in use is off by a factor of four.
+ * Called with dev->sem held.
+ */
+static void scull_auto_layout(struct scull_dev *dev, size_t count)
+{
+	unsigned long quantum;
+	u64 qset;
+
+	count = min_t(size_t, count, SCULL_QUANTUM_MAX);
+	if (!dev->avg_write)
+		dev->avg_write = count;
+	else
+		dev->avg_write = (dev->avg_write * 7 + count) / 8;
+
+	if (++dev->nr_writes % SCULL_AUTO_PERIOD || dev->shadow)
+		return;
+
+	quantum = clamp_t(unsigned long, dev->avg_write, SCULL_QUANTUM_MIN, SCULL_QUANTUM_MAX);
+	quantum = roundup_pow_of_two(quantum);
+	qset = div64_u64(dev->size, quantum) + 1;
+	qset = roundup_pow_of_two(clamp_t(u64, qset, SCULL_QSET_MIN, SCULL_QSET_MAX));
+
+	if (scull_off_by_4(dev->quantum, quantum) || scull_off_by_4(dev->qset, qset))
+		scull_compact_start(dev, quantum, qset);
+}
+
+struct scull_digest_state {
+	u32 crc;
+};
+
+static void scull_digest_update(struct scull_digest_state *st, const void *p, size_t len)
+{
+	/* libcrc32c hands this to the crypto API, crc32c-intel & co */
+	st->crc = crc32c(st->crc, p, len);
+}
+
+/*
+ * scull_digest_zero
+ * a hole hashes like the zeroes it reads back as
+ */
+static void scull_digest_zero(struct scull_digest_state *st, size_t len)
+{
+	const void *zero = page_address(ZERO_PAGE(0));
+	size_t n;
+
+	while (len) {
+		n = min_t(size_t, len, PAGE_SIZE);
+		scull_digest_update(st, zero, n);
+		len -= n;
+	}
+}
+
+/*
+ * scull_digest
+ * hash [offset, offset + length) straight from the quanta. dev->sem is
+ * dropped every SCULL_DIGEST_BATCH bytes, so a multi-GB range does not
+ * stall writers; the result is not a snapshot if they run meanwhile.
+ */
+static int scull_digest(struct scull_dev *dev, struct scull_digest *dg)
+{
+	struct scull_digest_state st;
+	loff_t pos, end;
+	size_t batch;
+	size_t avail;
+	char *src;
+
+	/* lib/xxhash is younger than the kernels this builds against */
+	if (dg->algo != SCULL_DIGEST_CRC32C)
+		return -EOPNOTSUPP;
+	st.crc = ~0;
+
+	if (dg->offset > MAX_LFS_FILESIZE)
+		return -EINVAL;
+	pos = dg->offset;
+
+	if (down_interruptible(&dev->sem))
+		return -ERESTARTSYS;
+	end = dev->size;
+	up(&dev->sem);
+	if (pos >= end)
+		end = pos; /* nothing stored there, digest of nothing */
+	else if (dg->length < end - pos)
+		end = pos + dg->length;
+
+	while (pos < end) {
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		for (batch = 0; pos < end && batch < SCULL_DIGEST_BATCH; batch += avail) {
+			src = scull_locate(dev, pos, 0, &avail);
+			if (avail > end - pos)
+				avail = end - pos;
+			if (src)
+				scull_digest_update(&st, src, avail);
+			else
+				scull_digest_zero(&st, avail);
+			pos += avail;
+		}
+		up(&dev->sem);
+
+		if (signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+
+	dg->digest = ~st.crc;
+
+	return 0;
+}
+
+static void scull_obj_free(struct scull_obj *obj)
+{
+	int i;
+
+	for (i = 0; i < obj->nr; i++)
+		kfree(obj->data[i]);
+	kfree(obj->data);
+	kfree(obj);
+}
+
+static void scull_obj_free_rcu(struct rcu_head *head)
+{
+	scull_obj_free(container_of(head, struct scull_obj, rcu));
+}
+
+/*
+ * scull_obj_put
+ * a GET may still be looking at obj under rcu_read_lock(), so the
+ * memory goes back only after a grace period
+ */
+static void scull_obj_put(struct scull_obj *obj)
+{
+	if (atomic_dec_and_test(&obj->refcount))
+		call_rcu(&obj->rcu, scull_obj_free_rcu);
+}
+
+/*
+ * scull_obj_alloc
+ * build an object from user memory, before any lock is taken
+ */
+static struct scull_obj *scull_obj_alloc(int quantum, const struct scull_kv_io *io)
+{
+	const char __user *value = (const char __user *)(unsigned long)io->value;
+	struct scull_obj *obj;
+	size_t n;
+	int i;
+
+	obj = kzalloc(sizeof(*obj) + io->key_len, GFP_KERNEL);
+	if (!obj)
+		return ERR_PTR(-ENOMEM);
+	atomic_set(&obj->refcount, 1);
+	obj->key_len = io->key_len;
+	obj->size = io->value_len;
+	if (copy_from_user(obj->key, (const char __user *)(unsigned long)io->key, io->key_len))
+		goto fault;
+
+	/* big objects use bigger quanta, so the run fits in one page */
+	obj->quantum = max_t(int, quantum, DIV_ROUND_UP(obj->size, SCULL_KV_RUN_MAX));
+	obj->nr = DIV_ROUND_UP(obj->size, obj->quantum);
+	if (obj->nr) {
+		obj->data = kcalloc(obj->nr, sizeof(void *), GFP_KERNEL);
+		if (!obj->data)
+			goto nomem;
+	}
+	for (i = 0; i < obj->nr; i++) {
+		n = min_t(size_t, obj->quantum, obj->size - (size_t)i * obj->quantum);
+		obj->data[i] = kmalloc(n, GFP_KERNEL);
+		if (!obj->data[i])
+			goto nomem;
+		if (copy_from_user(obj->data[i], value + (size_t)i * obj->quantum, n))
+			goto fault;
+	}
+
+	return obj;
+
+nomem:
+	scull_obj_free(obj);
+	return ERR_PTR(-ENOMEM);
+fault:
+	scull_obj_free(obj);
+	return ERR_PTR(-EFAULT);
+}
+
+static struct scull_kv_table *scull_kv_table_alloc(unsigned int bits)
+{
+	struct scull_kv_table *tbl;
+	int i;
+
+	tbl = kmalloc(sizeof(*tbl) + (sizeof(struct hlist_head) << bits), GFP_KERNEL);
+	if (!tbl)
+		return NULL;
+	tbl->bits = bits;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&tbl->buckets[i]);
+
+	return tbl;
+}
+
+static struct hlist_head *scull_kv_bucket(struct scull_kv_table *tbl, u32 hash)
+{
+	return &tbl->buckets[hash >> (32 - tbl->bits)];
+}
+
+/*
+ * scull_kv_lookup
+ * under rcu_read_lock(), or with kv->sem held
+ */
+static struct scull_obj *scull_kv_lookup(struct scull_kv_table *tbl, const char *key,
+					 unsigned int key_len, u32 hash)
+{
+	struct scull_obj *obj;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry_rcu(obj, pos, scull_kv_bucket(tbl, hash), hnode) {
+		if (obj->hash == hash && obj->key_len == key_len &&
+		    !memcmp(obj->key, key, key_len))
+			return obj;
+	}
+
+	return NULL;
+}
+
+/*
+ * scull_kv_grow
+ * double the table once it averages two objects a bucket. Called with
+ * kv->sem held.
+ */
+static void scull_kv_grow(struct scull_kv *kv)
+{
+	struct scull_kv_table *old = kv->table;
+	struct scull_kv_table *tbl;
+	struct scull_obj *obj;
+	struct hlist_node *pos, *n;
+	int i;
+
+	if (old->bits >= SCULL_KV_MAX_BITS || kv->count <= (2U << old->bits))
+		return;
+	tbl = scull_kv_table_alloc(old->bits + 1);
+	if (!tbl)
+		return; /* keep the longer chains */
+	tbl->seed = old->seed;
+
+	write_seqcount_begin(&kv->seq);
+	for (i = 0; i < (1 << old->bits); i++) {
+		hlist_for_each_entry_safe(obj, pos, n, &old->buckets[i], hnode) {
+			hlist_del_rcu(&obj->hnode);
+			hlist_add_head_rcu(&obj->hnode, scull_kv_bucket(tbl, obj->hash));
+		}
+	}
+	rcu_assign_pointer(kv->table, tbl);
+	write_seqcount_end(&kv->seq);
+
+	synchronize_rcu();
+	kfree(old);
+}
+
+static int scull_kv_put(struct scull_dev *dev, const struct scull_kv_io *io)
+{
+	struct scull_kv *kv = &dev->kv;
+	struct scull_kv_table *tbl;
+	struct scull_obj *obj, *old;
+
+	obj = scull_obj_alloc(ACCESS_ONCE(dev->quantum), io);
+	if (IS_ERR(obj))
+		return PTR_ERR(obj);
+
+	if (down_interruptible(&kv->sem)) {
+		scull_obj_free(obj);
+		return -ERESTARTSYS;
+	}
+	if (!kv->table) {
+		tbl = scull_kv_table_alloc(SCULL_KV_MIN_BITS);
+		if (!tbl) {
+			up(&kv->sem);
+			scull_obj_free(obj);
+			return -ENOMEM;
+		}
+		get_random_bytes(&tbl->seed, sizeof(tbl->seed));
+		/* GETs must not see the table before its buckets and seed */
+		rcu_assign_pointer(kv->table, tbl);
+	}
+
+	obj->hash = jhash(obj->key, obj->key_len, kv->table->seed);
+	old = scull_kv_lookup(kv->table, obj->key, obj->key_len, obj->hash);
+	if (old) {
+		hlist_replace_rcu(&old->hnode, &obj->hnode);
+		scull_obj_put(old);
+	} else {
+		hlist_add_head_rcu(&obj->hnode, scull_kv_bucket(kv->table, obj->hash));
+		kv->count++;
+		scull_kv_grow(kv);
+	}
+	up(&kv->sem);
+
+	return 0;
+}
+
+static int scull_kv_get(struct scull_dev *dev, struct scull_kv_io *io, const char *key)
+{
+	char __user *value = (char __user *)(unsigned long)io->value;
+	struct scull_kv *kv = &dev->kv;
+	struct scull_kv_table *tbl;
+	struct scull_obj *obj;
+	unsigned int seq;
+	size_t n;
+	u32 hash;
+	int retval = 0;
+	int i;
+
+	rcu_read_lock();
+	do {
+		seq = read_seqcount_begin(&kv->seq);
+		obj = NULL;
+		tbl = rcu_dereference(kv->table);
+		if (tbl) {
+			hash = jhash(key, io->key_len, tbl->seed);
+			obj = scull_kv_lookup(tbl, key, io->key_len, hash);
+		}
+		/* being replaced or deleted, it is gone for us */
+		if (obj && !atomic_inc_not_zero(&obj->refcount))
+			obj = NULL;
+	} while (!obj && read_seqcount_retry(&kv->seq, seq));
+	rcu_read_unlock();
+
+	if (!obj)
+		return -ENOENT;
+
+	/* our reference keeps the quanta, copy them without any lock */
+	if (io->value_len < obj->size) {
+		retval = -ERANGE;
+	} else {
+		for (i = 0; i < obj->nr; i++) {
+			n = min_t(size_t, obj->quantum, obj->size - (size_t)i * obj->quantum);
+			if (copy_to_user(value + (size_t)i * obj->quantum, obj->data[i], n)) {
+				retval = -EFAULT;
+				break;
+			}
+		}
+	}
+	io->value_len = obj->size;
+	scull_obj_put(obj);
+
+	return retval;
+}
+
+static int scull_kv_del(struct scull_dev *dev, const struct scull_kv_io *io, const char *key)
+{
+	struct scull_kv *kv = &dev->kv;
+	struct scull_obj *obj = NULL;
+
+	if (down_interruptible(&kv->sem))
+		return -ERESTARTSYS;
+	if (kv->table)
+		obj = scull_kv_lookup(kv->table, key, io->key_len,
+				      jhash(key, io->key_len, kv->table->seed));
+	if (obj) {
+		hlist_del_rcu(&obj->hnode);
+		kv->count--;
+		scull_obj_put(obj);
+	}
+	up(&kv->sem);
+
+	return obj ? 0 : -ENOENT;
+}
+
+/*
+ * scull_kv_destroy
+ * drop every object, nobody may have the device open
+ */
+static void scull_kv_destroy(struct scull_kv *kv)
+{
+	struct scull_obj *obj;
+	struct hlist_node *pos, *n;
+	int i;
+
+	if (!kv->table)
+		return;
+	for (i = 0; i < (1 << kv->table->bits); i++) {
+		hlist_for_each_entry_safe(obj, pos, n, &kv->table->buckets[i], hnode) {
+			hlist_del_rcu(&obj->hnode);
+			scull_obj_put(obj);
+		}
+	}
+	kfree(kv->table);
+	kv->table = NULL;
+	kv->count = 0;
+}
+
+/*
+ * scull_kv_ioctl
+ * SCULL_IOCKVPUT, SCULL_IOCKVGET and SCULL_IOCKVDEL
+ */
+static long scull_kv_ioctl(struct scull_dev *dev, unsigned int cmd, unsigned long arg)
+{
+	struct scull_kv_io io;
+	char key[SCULL_KV_KEY_MAX];
+	long retval;
+
+	if (copy_from_user(&io, (void __user *)arg, sizeof(io)))
+		return -EFAULT;
+	if (io.key_len == 0 || io.key_len > SCULL_KV_KEY_MAX)
+		return -EINVAL;
+
+	switch (cmd) {
+	case SCULL_IOCKVPUT:
+		if (io.value_len > SCULL_KV_VALUE_MAX)
+			return -EFBIG;
+		return scull_kv_put(dev, &io);
+
+	case SCULL_IOCKVGET:
+		if (copy_from_user(key, (const char __user *)(unsigned long)io.key, io.key_len))
+			return -EFAULT;
+		retval = scull_kv_get(dev, &io, key);
+		if (retval && retval != -ERANGE)
+			return retval;
+		if (put_user(io.value_len, &((struct scull_kv_io __user *)arg)->value_len))
+			return -EFAULT;
+		return retval;
+
+	case SCULL_IOCKVDEL:
+		if (copy_from_user(key, (const char __user *)(unsigned long)io.key, io.key_len))
+			return -EFAULT;
+		return scull_kv_del(dev, &io, key);
+	}
+
+	return -ENOTTY;
+}
+
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_dev *dev = filp->private_data;
+	struct scull_layout layout;
+	struct scull_digest dg;
+	long retval = 0;
+
+	switch (cmd) {
+	case SCULL_IOCGLAYOUT:
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		layout.quantum = dev->quantum;
+		layout.qset    = dev->qset;
+		up(&dev->sem);
+		if (copy_to_user((void __user *)arg, &layout, sizeof(layout)))
+			return -EFAULT;
+		break;
+
+	case SCULL_IOCSLAYOUT:
+		if (copy_from_user(&layout, (void __user *)arg, sizeof(layout)))
+			return -EFAULT;
+		if (layout.quantum < SCULL_QUANTUM_MIN || layout.quantum > SCULL_QUANTUM_MAX ||
+		    layout.qset < SCULL_QSET_MIN || layout.qset > SCULL_QSET_MAX)
+			return -EINVAL;
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		retval = scull_compact_start(dev, layout.quantum, layout.qset);
+		up(&dev->sem);
+		break;
+
+	case SCULL_IOCAUTO:
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		dev->auto_layout = !!arg;
+		dev->nr_writes = 0;
+		up(&dev->sem);
+		break;
+
+	case SCULL_IOCSYNC:
+		if (wait_event_interruptible(dev->compact_wait, !dev->shadow))
+			return -ERESTARTSYS;
+		break;
+
+	case SCULL_IOCDIGEST:
+		if (copy_from_user(&dg, (void __user *)arg, sizeof(dg)))
+			return -EFAULT;
+		retval = scull_digest(dev, &dg);
+		if (retval)
+			return retval;
+		if (copy_to_user((void __user *)arg, &dg, sizeof(dg)))
+			return -EFAULT;
+		break;
+
+	case SCULL_IOCKVPUT:
+	case SCULL_IOCKVGET:
+	case SCULL_IOCKVDEL:
+		return scull_kv_ioctl(dev, cmd, arg);
+
+	default:
+		return -ENOTTY;
+	}
+
+	return retval;
+}
+
 static int scull_release(struct inode *inode, struct file *filp)
 {
-	return 0; /* do nothing just return to OS */
+	if (scull_private != SCULL_SHARED)
+		scull_private_put(filp->private_data);
+
+	return 0;
 }
 
-static int scull_trim(struct scull_dev *dev)
+static void scull_free_qsets(struct rb_root *root, int qset)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset; /* dev != NULL */
+	struct scull_qset *dptr;
+	struct rb_node *node;
 	int i;
 
-	for (dptr = dev->data; dptr; dptr = next) {
+	while ((node = rb_first(root)) != NULL) {
+		dptr = rb_entry(node, struct scull_qset, node);
+		rb_erase(node, root);
 		if (dptr->data) {
 			for (i = 0; i < qset; i++)
 				kfree(dptr->data[i]);
 			kfree(dptr->data);
-			dptr->data = NULL;
 		}
-		next = dptr->next;
 		kfree(dptr);
 	}
+}
+
+/*
+ * scull_trim
+ * drop all data, the device keeps its current quantum and qset.
+ * Called with dev->sem held, or when nobody else can see dev.
+ */
+static int scull_trim(struct scull_dev *dev)
+{
+	if (dev->shadow)
+		scull_compact_abort(dev);
+
+	scull_free_qsets(&dev->data, dev->qset); /* dev != NULL */
 
 	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset    = scull_qset;
-	dev->data    = NULL;
+	dev->hint = NULL;
 
 	return 0;
 }
 
-static struct scull_qset *scull_follow(struct scull_dev *dev, int item)
+/*
+ * scull_follow
+ * find the scull_qset with the given index. The tree only holds the
+ * items that were ever written, so a multi-TB sparse device costs one
+ * node per touched item, and finding any of them O(log items). A
+ * missing item is inserted when create is set.
+ */
+static struct scull_qset *scull_follow(struct scull_dev *dev, loff_t item, int create)
 {
+	struct rb_node **link = &dev->data.rb_node;
+	struct rb_node *parent = NULL;
 	struct scull_qset *dptr;
-	struct scull_qset *next;
-	int i;
 
-	for (i = 0, dptr = dev->data; dptr && i < item; dptr = next) {
-		next = dptr->next;	
+	/* sequential access mostly stays within the last item found */
+	if (dev->hint && dev->hint->index == item)
+		return dev->hint;
+
+	while (*link) {
+		parent = *link;
+		dptr = rb_entry(parent, struct scull_qset, node);
+		if (item < dptr->index)
+			link = &parent->rb_left;
+		else if (item > dptr->index)
+			link = &parent->rb_right;
+		else
+			goto found;
 	}
-	
+
+	if (!create)
+		return NULL;
+	dptr = kzalloc(sizeof(*dptr), GFP_KERNEL);
+	if (!dptr)
+		return NULL;
+	dptr->index = item;
+	rb_link_node(&dptr->node, parent, link);
+	rb_insert_color(&dptr->node, &dev->data);
+
+found:
+	dev->hint = dptr;
 	return dptr;
 }
 
@@ -257,6 +1266,12 @@ static int __init scull_module_init(void)
 	dev_t devno; /* dev number */
 	int result;
 
+	/* scull_reap() would requeue itself with no delay, forever */
+	if (scull_private != SCULL_SHARED && scull_idle_timeout <= 0) {
+		printk(KERN_ERR "scull: scull_idle_timeout must be positive\n");
+		return -EINVAL;
+	}
+
 	/* register a major number for our device */
 	if (scull_major) {
 		devno = MKDEV(scull_major, scull_minor);
@@ -267,16 +1282,39 @@ static int __init scull_module_init(void)
 	}
 	
 	/* initialise semaphore before device register */
-	init_MUTEX(&dev.sem);
+	scull_dev_init(&dev);
 	for (i = 0; i < scull_nr_devs; i++)
 		scull_setup_cdev(&dev, i);
+
+	for (i = 0; i < ARRAY_SIZE(scull_hash); i++)
+		INIT_HLIST_HEAD(&scull_hash[i]);
+	if (scull_private != SCULL_SHARED)
+		schedule_delayed_work(&scull_reap_work, scull_idle_timeout * HZ);
 	
 	return 0;
 }
 
 static void __exit scull_module_exit(void)
 {
+	struct scull_listitem *lptr;
+	struct hlist_node *pos, *n;
+	int i;
+
 	cdev_del(&dev.cdev);	
+	scull_dev_destroy(&dev);
+
+	/* nobody can open us any more, free every private device */
+	cancel_delayed_work_sync(&scull_reap_work);
+	for (i = 0; i < ARRAY_SIZE(scull_hash); i++) {
+		hlist_for_each_entry_safe(lptr, pos, n, &scull_hash[i], hnode) {
+			hlist_del(&lptr->hnode);
+			scull_dev_destroy(&lptr->device);
+			kfree(lptr);
+		}
+	}
+
+	/* key-value objects still waiting for their grace period */
+	rcu_barrier();
 }
 
 module_init(scull_module_init);
@@ -0,0 +1,59 @@
+#ifndef _SCULL3_H
+#define _SCULL3_H
+
+#include <linux/ioctl.h>
+
+/*
+ * ioctl interface of scull3, shared with the programs in scull3/app
+ */
+#define SCULL_IOC_MAGIC 'k'
+
+struct scull_layout {
+	int quantum; /* bytes per quantum */
+	int qset;    /* quanta per scull_qset */
+};
+
+/* current layout */
+#define SCULL_IOCGLAYOUT _IOR(SCULL_IOC_MAGIC, 1, struct scull_layout)
+/* switch to a new layout, existing data is repacked in the background */
+#define SCULL_IOCSLAYOUT _IOW(SCULL_IOC_MAGIC, 2, struct scull_layout)
+/* arg != 0: pick the layout from observed write sizes */
+#define SCULL_IOCAUTO    _IO(SCULL_IOC_MAGIC, 3)
+/* wait until a running repack has finished */
+#define SCULL_IOCSYNC    _IO(SCULL_IOC_MAGIC, 4)
+
+#define SCULL_DIGEST_CRC32C 0
+#define SCULL_DIGEST_XXH64  1 /* reserved, fails with EOPNOTSUPP */
+
+struct scull_digest {
+	unsigned long long offset; /* in */
+	unsigned long long length; /* in, clipped to the device size */
+	unsigned int algo;         /* in, SCULL_DIGEST_* */
+	unsigned int pad;
+	unsigned long long digest; /* out, holes count as zeroes */
+};
+
+/* hash a byte range in the kernel, without copying it to user space */
+#define SCULL_IOCDIGEST  _IOWR(SCULL_IOC_MAGIC, 5, struct scull_digest)
+
+#define SCULL_KV_KEY_MAX   255
+#define SCULL_KV_VALUE_MAX (16 * 1024 * 1024)
+
+/*
+ * objects stored by key, next to (not inside) the byte stream
+ */
+struct scull_kv_io {
+	unsigned long long key;   /* in, user pointer */
+	unsigned long long value; /* in, user pointer */
+	unsigned int key_len;     /* in, 1 .. SCULL_KV_KEY_MAX */
+	unsigned int value_len;   /* PUT: in; GET: in buffer size, out object size */
+};
+
+/* store or replace an object */
+#define SCULL_IOCKVPUT   _IOW(SCULL_IOC_MAGIC, 6, struct scull_kv_io)
+/* fetch an object, -ERANGE and the needed value_len if the buffer is short */
+#define SCULL_IOCKVGET   _IOWR(SCULL_IOC_MAGIC, 7, struct scull_kv_io)
+/* remove an object */
+#define SCULL_IOCKVDEL   _IOW(SCULL_IOC_MAGIC, 8, struct scull_kv_io)
+
+#endif /* _SCULL3_H */